@@ -0,0 +1,435 @@
+// macro benchmark: generates synthetic trees and times whole archive operations
+// results are written as JSON so runs can be compared across changes
+//
+// usage: bench [--dir DIR] [--seed N] [--scale N] [--out FILE]
+
+#include "../tar.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <utime.h>
+#include <dirent.h>
+#include <sys/resource.h>
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+
+// reproducible pseudo random numbers (xorshift64*)
+static unsigned long long state = 1;
+
+static unsigned long long next_random(void){
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
+}
+
+static int make_dir(const char * path){
+#ifdef _WIN32
+    const int rc = mkdir(path);
+#else
+    const int rc = mkdir(path, 0755);
+#endif
+    return ((rc < 0) && (errno != EEXIST))?-1:0;
+}
+
+// description of a generated data set
+struct dataset {
+    const char * name;
+    int files;                              // number of regular files
+    unsigned long long min_size;            // file size range
+    unsigned long long max_size;
+    int depth;                              // directory nesting of each file
+    char sparse;                            // files are mostly holes
+};
+
+// what was generated, needed to drive update/remove
+struct tree {
+    char ** paths;                          // regular files, relative to the working directory
+    int count;
+    unsigned long long bytes;
+};
+
+static void tree_free(struct tree * tree){
+    for(int i = 0; i < tree -> count; i++){
+        free(tree -> paths[i]);
+    }
+    free(tree -> paths);
+}
+
+static int write_file(const char * path, unsigned long long size, const char sparse){
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        return -1;
+    }
+
+    char buf[65536];
+    if (sparse){
+        // a little data at both ends, holes in between
+        for(size_t i = 0; i < sizeof(buf); i++){
+            buf[i] = (char) next_random();
+        }
+        const unsigned int head = MIN(size, 4096);
+        if ((write(fd, buf, head) != head) || (ftruncate(fd, size) < 0)){
+            close(fd);
+            return -1;
+        }
+    }
+    else{
+        unsigned long long done = 0;
+        while (done < size){
+            const unsigned int want = MIN(size - done, sizeof(buf));
+            for(unsigned int i = 0; i < want; i += 8){
+                const unsigned long long r = next_random();
+                memcpy(buf + i, &r, MIN(8, want - i));
+            }
+            if (write(fd, buf, want) != want){
+                close(fd);
+                return -1;
+            }
+            done += want;
+        }
+    }
+
+    close(fd);
+    return 0;
+}
+
+static int generate(const struct dataset * set, struct tree * tree){
+    memset(tree, 0, sizeof(struct tree));
+    tree -> paths = calloc(set -> files, sizeof(char *));
+
+    if (make_dir(set -> name) < 0){
+        return -1;
+    }
+
+    for(int i = 0; i < set -> files; i++){
+        // spread files over a few directories per level
+        char path[4096];
+        int len = snprintf(path, sizeof(path), "%s", set -> name);
+        for(int d = 0; d < set -> depth; d++){
+            len += snprintf(path + len, sizeof(path) - len, "/d%d", (int) ((i >> (2 * d)) % 4));
+            if (make_dir(path) < 0){
+                return -1;
+            }
+        }
+        snprintf(path + len, sizeof(path) - len, "/f%d", i);
+
+        unsigned long long size = set -> min_size;
+        if (set -> max_size > set -> min_size){
+            size += next_random() % (set -> max_size - set -> min_size);
+        }
+
+        if (write_file(path, size, set -> sparse) < 0){
+            fprintf(stderr, "Error: Unable to write %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+
+        tree -> paths[tree -> count++] = strdup(path);
+        tree -> bytes += size;
+    }
+
+    return 0;
+}
+
+// counters sampled around each operation
+struct sample {
+    struct timespec time;
+    unsigned long long syscr;               // read syscalls
+    unsigned long long syscw;               // write syscalls
+    unsigned long long rchar;               // bytes read
+    unsigned long long wchar;               // bytes written
+};
+
+static void take_sample(struct sample * s){
+    memset(s, 0, sizeof(struct sample));
+    clock_gettime(CLOCK_MONOTONIC, &s -> time);
+
+    // only available on linux; counters stay zero elsewhere
+    FILE * io = fopen("/proc/self/io", "r");
+    if (io){
+        char key[32];
+        unsigned long long value;
+        while (fscanf(io, "%31[^:]: %llu\n", key, &value) == 2){
+            if (!strcmp(key, "syscr")){
+                s -> syscr = value;
+            }
+            else if (!strcmp(key, "syscw")){
+                s -> syscw = value;
+            }
+            else if (!strcmp(key, "rchar")){
+                s -> rchar = value;
+            }
+            else if (!strcmp(key, "wchar")){
+                s -> wchar = value;
+            }
+        }
+        fclose(io);
+    }
+}
+
+static long peak_rss_kb(void){
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0){
+        return -1;
+    }
+    return usage.ru_maxrss;
+}
+
+// the archive functions print progress and errors; keep them out of the results
+static int quiet_stdout = -1;
+static int quiet_stderr = -1;
+
+static void silence(void){
+    fflush(stdout);
+    fflush(stderr);
+    quiet_stdout = dup(STDOUT_FILENO);
+    quiet_stderr = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    close(null);
+}
+
+static void unsilence(void){
+    fflush(stdout);
+    fflush(stderr);
+    dup2(quiet_stdout, STDOUT_FILENO);
+    dup2(quiet_stderr, STDERR_FILENO);
+    close(quiet_stdout);
+    close(quiet_stderr);
+}
+
+static void report(FILE * out, const char * op, const struct sample * before, const struct sample * after,
+                   const int files, const unsigned long long bytes, const int rc, const char last){
+    const double seconds = (after -> time.tv_sec - before -> time.tv_sec) + (after -> time.tv_nsec - before -> time.tv_nsec) / 1e9;
+    fprintf(out, "        {\"op\": \"%s\", \"ok\": %s, \"seconds\": %.6f, \"files\": %d, \"bytes\": %llu, "
+                 "\"mb_per_s\": %.2f, \"files_per_s\": %.1f, \"read_syscalls\": %llu, \"write_syscalls\": %llu, "
+                 "\"bytes_read\": %llu, \"bytes_written\": %llu, \"peak_rss_kb\": %ld}%s\n",
+            op, (rc < 0)?"false":"true", seconds, files, bytes,
+            seconds > 0?bytes / seconds / 1e6:0, seconds > 0?files / seconds:0,
+            after -> syscr - before -> syscr, after -> syscw - before -> syscw,
+            after -> rchar - before -> rchar, after -> wchar - before -> wchar,
+            peak_rss_kb(), last?"":",");
+}
+
+static int remove_tree(const char * path){
+    struct stat st;
+    if (lstat(path, &st) < 0){
+        return 0;
+    }
+
+    if (S_ISDIR(st.st_mode)){
+        DIR * d = opendir(path);
+        if (!d){
+            return -1;
+        }
+
+        struct dirent * dir;
+        while ((dir = readdir(d))){
+            if (!strcmp(dir -> d_name, ".") || !strcmp(dir -> d_name, "..")){
+                continue;
+            }
+            char sub[4096];
+            snprintf(sub, sizeof(sub), "%s/%s", path, dir -> d_name);
+            remove_tree(sub);
+        }
+        closedir(d);
+        return rmdir(path);
+    }
+
+    return unlink(path);
+}
+
+// clean up after a data set and close its JSON object
+static int finish(FILE * out, const struct dataset * set, struct tree * tree, struct tar_t * archive, const int fd, const char * archive_name, const char last, const int ret){
+    tar_free(archive);
+    if (fd >= 0){
+        close(fd);
+    }
+    unlink(archive_name);
+    remove_tree(set -> name);
+    tree_free(tree);
+
+    fprintf(out, "    ]}%s\n", last?"":",");
+    return ret;
+}
+
+static int run(FILE * out, const struct dataset * set, const char last){
+    char archive_name[256];
+    snprintf(archive_name, sizeof(archive_name), "%s.tar", set -> name);
+    unlink(archive_name);
+
+    struct tree tree;
+    const int generated = generate(set, &tree);
+
+    fprintf(out, "    {\"dataset\": \"%s\", \"files\": %d, \"bytes\": %llu, \"ops\": [\n", set -> name, tree.count, tree.bytes);
+    if (generated < 0){
+        return finish(out, set, &tree, NULL, -1, archive_name, last, -1);
+    }
+
+    struct sample before, after;
+    const char verbosity = 0;
+    int rc;
+
+    // create
+    const char * root[] = { set -> name };
+    int fd = open(archive_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    struct tar_t * archive = NULL;
+    silence();
+    take_sample(&before);
+    rc = tar_write(fd, &archive, 1, root, verbosity);
+    take_sample(&after);
+    unsilence();
+    report(out, "create", &before, &after, tree.count, tree.bytes, rc, 0);
+    tar_free(archive);
+    close(fd);
+
+    // list
+    fd = open(archive_name, O_RDWR);
+    archive = NULL;
+    silence();
+    take_sample(&before);
+    rc = tar_read(fd, &archive, verbosity);
+    take_sample(&after);
+    unsilence();
+    report(out, "list", &before, &after, tree.count, 0, rc, 0);
+
+    // extract into a scratch directory
+    char scratch[256];
+    snprintf(scratch, sizeof(scratch), "%s.out", set -> name);
+    remove_tree(scratch);
+    make_dir(scratch);
+    if (chdir(scratch) < 0){
+        take_sample(&before);
+        report(out, "extract", &before, &before, tree.count, 0, -1, 1);
+        return finish(out, set, &tree, archive, fd, archive_name, last, -1);
+    }
+    silence();
+    take_sample(&before);
+    rc = tar_extract(fd, archive, 0, NULL, verbosity);
+    take_sample(&after);
+    unsilence();
+    if (chdir("..") < 0){
+        report(out, "extract", &before, &after, tree.count, tree.bytes, rc, 1);
+        return finish(out, set, &tree, archive, fd, archive_name, last, -1);
+    }
+    report(out, "extract", &before, &after, tree.count, tree.bytes, rc, 0);
+    remove_tree(scratch);
+
+    // diff against the source tree
+    silence();
+    take_sample(&before);
+    rc = tar_diff(stdout, archive, verbosity);
+    take_sample(&after);
+    unsilence();
+    report(out, "diff", &before, &after, tree.count, 0, rc, 0);
+
+    // update a tenth of the files
+    const int changed = MAX(tree.count / 10, 1);
+    for(int i = 0; i < changed; i++){
+        struct utimbuf times = { time(NULL) + 60, time(NULL) + 60 };
+        utime(tree.paths[i * (tree.count / changed)], &times);
+    }
+    const char ** update = calloc(changed, sizeof(char *));
+    for(int i = 0; i < changed; i++){
+        update[i] = tree.paths[i * (tree.count / changed)];
+    }
+    silence();
+    take_sample(&before);
+    rc = tar_update(fd, &archive, changed, update, verbosity);
+    take_sample(&after);
+    unsilence();
+    report(out, "update", &before, &after, changed, 0, rc, 0);
+    free(update);
+
+    // remove the same number of entries
+    tar_free(archive);
+    archive = NULL;
+    lseek(fd, 0, SEEK_SET);
+    tar_read(fd, &archive, verbosity);
+    const char ** names = calloc(changed, sizeof(char *));
+    int found = 0;
+    for(struct tar_t * entry = archive; entry && (found < changed); entry = entry -> next){
+        // originals come first, so these names are unique
+        if (entry -> type == NORMAL){
+            names[found++] = strdup(tar_entry_name(entry));
+        }
+    }
+    silence();
+    take_sample(&before);
+    rc = tar_remove(fd, &archive, found, names, verbosity);
+    take_sample(&after);
+    unsilence();
+    report(out, "remove", &before, &after, found, 0, rc, 1);
+    for(int i = 0; i < found; i++){
+        free((char *) names[i]);
+    }
+    free(names);
+
+    return finish(out, set, &tree, archive, fd, archive_name, last, 0);
+}
+
+int main(int argc, char ** argv){
+    const char * dir = "bench.tmp";
+    const char * path = NULL;
+    unsigned long long seed = 42;
+    int scale = 1;
+
+    for(int i = 1; i < argc; i++){
+        if (!strcmp(argv[i], "--dir") && (i + 1 < argc)){
+            dir = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--seed") && (i + 1 < argc)){
+            seed = strtoull(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "--scale") && (i + 1 < argc)){
+            scale = MAX(atoi(argv[++i]), 1);
+        }
+        else if (!strcmp(argv[i], "--out") && (i + 1 < argc)){
+            path = argv[++i];
+        }
+        else{
+            fprintf(stderr, "usage: %s [--dir DIR] [--seed N] [--scale N] [--out FILE]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    state = seed?seed:1;
+
+    FILE * out = path?fopen(path, "w"):stdout;
+    if (!out){
+        fprintf(stderr, "Error: Unable to open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    const struct dataset sets[] = {
+        { "tiny",   2000 * scale,  0,                 1024,              2, 0 },
+        { "huge",   2,             32 * 1024 * 1024,  32ULL * 1024 * 1024 * scale, 0, 0 },
+        { "deep",   500 * scale,   512,               8192,              12, 0 },
+        { "sparse", 8,             4 * 1024 * 1024,   16ULL * 1024 * 1024 * scale, 1, 1 },
+    };
+    const int count = sizeof(sets) / sizeof(sets[0]);
+
+    if ((make_dir(dir) < 0) || (chdir(dir) < 0)){
+        fprintf(stderr, "Error: Unable to use %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+
+    fprintf(out, "{\n  \"seed\": %llu,\n  \"scale\": %d,\n  \"results\": [\n", seed, scale);
+    int ret = 0;
+    for(int i = 0; i < count; i++){
+        if (run(out, &sets[i], i == count - 1) < 0){
+            fprintf(stderr, "Error: Data set %s failed\n", sets[i].name);
+            ret = 1;
+        }
+    }
+    fprintf(out, "  ],\n  \"peak_rss_kb\": %ld\n}\n", peak_rss_kb());
+
+    if (out != stdout){
+        fclose(out);
+    }
+    return ret;
+}
@@ -0,0 +1,316 @@
+// micro benchmarks for the header codec and other hot primitives in tar.c
+// inputs come from a fixed seed so numbers are comparable between runs
+//
+// usage: microbench [--iterations N] [--save FILE] [--baseline FILE] [--tolerance PERCENT]
+//   --save      write the measured ns/item of every case to FILE
+//   --baseline  compare against a file written by --save; exits with 1 on regressions
+
+#include "../tar.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define MAX_CASES 16
+
+// reproducible pseudo random numbers (xorshift64*)
+static unsigned long long state = 42;
+
+static unsigned long long next_random(void){
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
+}
+
+// results are fed here so the compiler cannot drop the work
+static volatile unsigned long long sink;
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// inputs shared by the cases
+#define ENTRIES 1024
+static struct tar_t headers[ENTRIES];
+static char octal[ENTRIES][12];
+static char zero[512];
+static struct tar_t * list;
+static const char * names[16];
+static char tmpdir[64];
+static char * paths[64];
+static int archive_fd = -1;
+
+static void setup(void){
+    for(int i = 0; i < ENTRIES; i++){
+        snprintf(octal[i], sizeof(octal[i]), "%011o", (unsigned int) (next_random() & 0x7fffffff));
+
+        memset(&headers[i], 0, sizeof(struct tar_t));
+        snprintf(headers[i].name, sizeof(headers[i].name), "dir%d/file%llu.txt", i % 7, next_random() % 100000);
+        memcpy(headers[i].mode, "0000644", 7);
+        memcpy(headers[i].size, octal[i], 11);
+        headers[i].type = NORMAL;
+    }
+
+    // linked list for lookups, queried with names from the back half
+    struct tar_t ** tail = &list;
+    for(int i = 0; i < ENTRIES; i++){
+        *tail = calloc(1, sizeof(struct tar_t));
+        memcpy((*tail) -> block, headers[i].block, 512);
+        (*tail) -> original_name = headers[i].name;
+        tail = &((*tail) -> next);
+    }
+    for(int i = 0; i < 16; i++){
+        names[i] = headers[ENTRIES / 2 + (next_random() % (ENTRIES / 2))].name;
+    }
+
+    // small files to stat
+    snprintf(tmpdir, sizeof(tmpdir), "/tmp/microbench.%d", (int) getpid());
+#ifdef _WIN32
+    mkdir(tmpdir);
+#else
+    mkdir(tmpdir, 0755);
+#endif
+    for(int i = 0; i < 64; i++){
+        paths[i] = malloc(strlen(tmpdir) + 16);
+        sprintf(paths[i], "%s/f%d", tmpdir, i);
+        int fd = open(paths[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0){
+            close(fd);
+        }
+    }
+
+    // archive with ENTRIES empty members for the header walk
+    char path[96];
+    snprintf(path, sizeof(path), "%s/walk.tar", tmpdir);
+    archive_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    for(int i = 0; i < ENTRIES; i++){
+        struct tar_t entry = headers[i];
+        memcpy(entry.size, "00000000000", 11);
+        calculate_checksum(&entry);
+        if (write(archive_fd, entry.block, 512) != 512){
+            break;
+        }
+    }
+    write_end_data(archive_fd, ENTRIES * 512, 0);
+}
+
+static void teardown(void){
+    for(int i = 0; i < 64; i++){
+        unlink(paths[i]);
+        free(paths[i]);
+    }
+    char path[96];
+    snprintf(path, sizeof(path), "%s/walk.tar", tmpdir);
+    close(archive_fd);
+    unlink(path);
+    rmdir(tmpdir);
+    tar_free(list);
+}
+
+// each case processes a batch of items per call
+// returns number of items processed
+static int case_oct2uint(void){
+    unsigned long long sum = 0;
+    for(int i = 0; i < ENTRIES; i++){
+        sum += oct2uint(octal[i], 11);
+    }
+    sink += sum;
+    return ENTRIES;
+}
+
+static int case_octal_encode(void){
+    for(int i = 0; i < ENTRIES; i++){
+        tar_set_size(&headers[i], tar_get_size(&headers[i]) + 1);
+    }
+    sink += headers[0].size[10];
+    return ENTRIES;
+}
+
+static int case_checksum(void){
+    unsigned long long sum = 0;
+    for(int i = 0; i < ENTRIES; i++){
+        sum += calculate_checksum(&headers[i]);
+    }
+    sink += sum;
+    return ENTRIES;
+}
+
+static int case_iszeroed(void){
+    int sum = 0;
+    for(int i = 0; i < ENTRIES; i++){
+        sum += iszeroed(zero, sizeof(zero));
+    }
+    sink += sum;
+    return ENTRIES;
+}
+
+static int case_format(void){
+    struct tar_t entry;
+    for(int i = 0; i < 64; i++){
+        format_tar_data(&entry, paths[i], NULL, 0);
+        sink += entry.block[0];
+    }
+    return 64;
+}
+
+static int case_exists(void){
+    for(int i = 0; i < 16; i++){
+        sink += (unsigned long long) exists(list, names[i], 1);
+    }
+    return 16;
+}
+
+static int case_check_match(void){
+    int sum = 0;
+    for(int i = 0; i < ENTRIES; i++){
+        sum += check_match(&headers[i], 16, names);
+    }
+    sink += sum;
+    return ENTRIES;
+}
+
+static int case_walk(void){
+    struct tar_t * archive = NULL;
+    lseek(archive_fd, 0, SEEK_SET);
+    const int count = tar_read(archive_fd, &archive, 0);
+    tar_free(archive);
+    return count;
+}
+
+struct bench_case {
+    const char * name;
+    int (*run)(void);
+    int bytes;                              // bytes per item, 0 if not meaningful
+};
+
+static const struct bench_case cases[] = {
+    { "oct2uint",           case_oct2uint,      11 },
+    { "octal_encode",       case_octal_encode,  11 },
+    { "calculate_checksum", case_checksum,      512 },
+    { "iszeroed",           case_iszeroed,      512 },
+    { "format_tar_data",    case_format,        0 },
+    { "exists",             case_exists,        0 },
+    { "check_match",        case_check_match,   0 },
+    { "tar_read_walk",      case_walk,          512 },
+};
+
+// lowest time per item over a few repetitions
+static double measure(const struct bench_case * c, const int iterations){
+    double best = -1;
+    for(int rep = 0; rep < 5; rep++){
+        long long items = 0;
+        const double start = now();
+        for(int i = 0; i < iterations; i++){
+            items += c -> run();
+        }
+        const double per = (now() - start) / (items?items:1);
+        if ((best < 0) || (per < best)){
+            best = per;
+        }
+    }
+    return best;
+}
+
+static double baseline_of(FILE * baseline, const char * name){
+    if (!baseline){
+        return -1;
+    }
+
+    rewind(baseline);
+    char key[64];
+    double value;
+    while (fscanf(baseline, "%63s %lf", key, &value) == 2){
+        if (!strcmp(key, name)){
+            return value;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char ** argv){
+    int iterations = 200;
+    const char * save = NULL;
+    const char * base = NULL;
+    double tolerance = 10;
+
+    for(int i = 1; i < argc; i++){
+        if (!strcmp(argv[i], "--iterations") && (i + 1 < argc)){
+            iterations = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--save") && (i + 1 < argc)){
+            save = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--baseline") && (i + 1 < argc)){
+            base = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--tolerance") && (i + 1 < argc)){
+            tolerance = atof(argv[++i]);
+        }
+        else{
+            fprintf(stderr, "usage: %s [--iterations N] [--save FILE] [--baseline FILE] [--tolerance PERCENT]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    FILE * baseline = NULL;
+    if (base && !(baseline = fopen(base, "r"))){
+        fprintf(stderr, "Error: Unable to open %s: %s\n", base, strerror(errno));
+        return 2;
+    }
+
+    setup();
+
+    int regressions = 0;
+    double results[MAX_CASES];
+    const int count = sizeof(cases) / sizeof(cases[0]);
+
+    printf("%-20s %12s %10s %14s %10s\n", "case", "ns/item", "ns/byte", "items/s", "vs base");
+    for(int i = 0; i < count; i++){
+        const double ns = measure(&cases[i], iterations);
+        results[i] = ns;
+
+        char bytes[16] = "-";
+        if (cases[i].bytes){
+            snprintf(bytes, sizeof(bytes), "%.3f", ns / cases[i].bytes);
+        }
+
+        char delta[16] = "-";
+        const double old = baseline_of(baseline, cases[i].name);
+        if (old > 0){
+            const double change = (ns - old) * 100 / old;
+            snprintf(delta, sizeof(delta), "%+.1f%%", change);
+            if (change > tolerance){
+                regressions++;
+            }
+        }
+
+        printf("%-20s %12.2f %10s %14.0f %10s\n", cases[i].name, ns, bytes, 1e9 / ns, delta);
+    }
+
+    if (save){
+        FILE * out = fopen(save, "w");
+        if (!out){
+            fprintf(stderr, "Error: Unable to open %s: %s\n", save, strerror(errno));
+        }
+        else{
+            for(int i = 0; i < count; i++){
+                fprintf(out, "%s %.3f\n", cases[i].name, results[i]);
+            }
+            fclose(out);
+        }
+    }
+
+    if (baseline){
+        fclose(baseline);
+        if (regressions){
+            printf("%d case(s) slower than baseline by more than %.1f%%\n", regressions, tolerance);
+        }
+    }
+
+    teardown();
+    return regressions?1:0;
+}
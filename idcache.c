@@ -0,0 +1,201 @@
+#include "idcache.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#ifndef _WIN32
+#include <grp.h>
+#include <pwd.h>
+#endif
+
+// one known pairing; name is NULL if an id has no name, found is 0 if a name has no id
+struct idcache_entry {
+    unsigned int id;
+    char * name;
+    char found;
+    char used;
+};
+
+// open addressed table keyed either by id or by name
+struct idcache {
+    pthread_mutex_t lock;
+    char byname;                            // entries are looked up by name
+    struct idcache_entry * slots;
+    unsigned int buckets;                   // size of slots (power of 2)
+    unsigned int count;
+};
+
+static struct idcache users = { PTHREAD_MUTEX_INITIALIZER, 0, NULL, 0, 0 };
+static struct idcache groups = { PTHREAD_MUTEX_INITIALIZER, 0, NULL, 0, 0 };
+static struct idcache user_ids = { PTHREAD_MUTEX_INITIALIZER, 1, NULL, 0, 0 };
+static struct idcache group_ids = { PTHREAD_MUTEX_INITIALIZER, 1, NULL, 0, 0 };
+
+static unsigned int idcache_hash(const struct idcache * cache, const unsigned int id, const char * name){
+    if (!cache -> byname){
+        return id * 2654435761u;
+    }
+
+    unsigned int hash = 2166136261u;
+    for(; *name; name++){
+        hash = (hash ^ (unsigned char) *name) * 16777619u;
+    }
+    return hash;
+}
+
+static struct idcache_entry * idcache_find(struct idcache * cache, const unsigned int id, const char * name){
+    unsigned int i = idcache_hash(cache, id, name) & (cache -> buckets - 1);
+    while (cache -> slots[i].used){
+        const struct idcache_entry * entry = &cache -> slots[i];
+        if (cache -> byname?!strcmp(entry -> name, name):(entry -> id == id)){
+            break;
+        }
+        i = (i + 1) & (cache -> buckets - 1);
+    }
+    return &cache -> slots[i];
+}
+
+// keep the table at most half full
+static int idcache_grow(struct idcache * cache){
+    if (cache -> slots && ((cache -> count + 1) * 2 <= cache -> buckets)){
+        return 0;
+    }
+
+    struct idcache_entry * old = cache -> slots;
+    const unsigned int buckets = cache -> buckets;
+
+    cache -> buckets = buckets?(2 * buckets):64;
+    if (!(cache -> slots = calloc(cache -> buckets, sizeof(struct idcache_entry)))){
+        cache -> slots = old;
+        cache -> buckets = buckets;
+        return -1;
+    }
+
+    for(unsigned int i = 0; i < buckets; i++){
+        if (old[i].used){
+            *idcache_find(cache, old[i].id, old[i].name) = old[i];
+        }
+    }
+    free(old);
+
+    return 0;
+}
+
+// resolve a key that is not cached yet
+// the reentrant lookups are retried with larger buffers until the entry fits
+static void idcache_lookup(const struct idcache * cache, struct idcache_entry * entry){
+#ifndef _WIN32
+    size_t size = 1024;
+    char * buf = NULL;
+    int rc;
+    do{
+        free(buf);
+        size *= 2;
+        if (!(buf = malloc(size))){
+            return;
+        }
+
+        if (cache == &users){
+            struct passwd pw, * result = NULL;
+            if (!(rc = getpwuid_r(entry -> id, &pw, buf, size, &result)) && result){
+                entry -> name = strdup(pw.pw_name);
+            }
+        }
+        else if (cache == &groups){
+            struct group gr, * result = NULL;
+            if (!(rc = getgrgid_r(entry -> id, &gr, buf, size, &result)) && result){
+                entry -> name = strdup(gr.gr_name);
+            }
+        }
+        else if (cache == &user_ids){
+            struct passwd pw, * result = NULL;
+            if (!(rc = getpwnam_r(entry -> name, &pw, buf, size, &result)) && result){
+                entry -> id = pw.pw_uid;
+                entry -> found = 1;
+            }
+        }
+        else{
+            struct group gr, * result = NULL;
+            if (!(rc = getgrnam_r(entry -> name, &gr, buf, size, &result)) && result){
+                entry -> id = gr.gr_gid;
+                entry -> found = 1;
+            }
+        }
+    } while ((rc == ERANGE) && (size < (1 << 20)));
+    free(buf);
+#endif
+}
+
+// copy of the cached entry for a key, looking it up on first use
+// unknown keys are cached as well so they are not looked up again
+// (a copy, since the table may move once the lock is released; names never move)
+// lookups can be slow (LDAP, SSSD), so they run without the lock; if two threads look up
+// the same key, the first to insert it wins
+static int idcache_get(struct idcache * cache, const unsigned int id, const char * name, struct idcache_entry * out){
+    pthread_mutex_lock(&cache -> lock);
+    if (cache -> slots){
+        const struct idcache_entry * entry = idcache_find(cache, id, name);
+        if (entry -> used){
+            *out = *entry;
+            pthread_mutex_unlock(&cache -> lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&cache -> lock);
+
+    struct idcache_entry found = { id, cache -> byname?strdup(name):NULL, 0, 1 };
+    if (cache -> byname && !found.name){
+        return -1;
+    }
+    idcache_lookup(cache, &found);
+
+    pthread_mutex_lock(&cache -> lock);
+    if (idcache_grow(cache) < 0){
+        pthread_mutex_unlock(&cache -> lock);
+        free(found.name);
+        return -1;
+    }
+
+    struct idcache_entry * entry = idcache_find(cache, id, name);
+    if (entry -> used){
+        free(found.name);
+    }
+    else{
+        *entry = found;
+        cache -> count++;
+    }
+    *out = *entry;
+    pthread_mutex_unlock(&cache -> lock);
+
+    return 0;
+}
+
+const char * idcache_user(const uid_t uid){
+    struct idcache_entry entry;
+    return (idcache_get(&users, uid, NULL, &entry) < 0)?NULL:entry.name;
+}
+
+const char * idcache_group(const gid_t gid){
+    struct idcache_entry entry;
+    return (idcache_get(&groups, gid, NULL, &entry) < 0)?NULL:entry.name;
+}
+
+int idcache_uid(const char * name, uid_t * uid){
+    struct idcache_entry entry;
+    if (!name || !*name || (idcache_get(&user_ids, 0, name, &entry) < 0) || !entry.found){
+        return -1;
+    }
+    *uid = entry.id;
+    return 0;
+}
+
+int idcache_gid(const char * name, gid_t * gid){
+    struct idcache_entry entry;
+    if (!name || !*name || (idcache_get(&group_ids, 0, name, &entry) < 0) || !entry.found){
+        return -1;
+    }
+    *gid = entry.id;
+    return 0;
+}
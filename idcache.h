@@ -0,0 +1,19 @@
+#ifndef IDCACHE_H_INCLUDED
+#define IDCACHE_H_INCLUDED
+
+#include <sys/types.h>
+
+// user and group names are looked up once per id (or name) and kept for the rest of the run
+// lookups may come from any thread; returned names stay valid until exit
+
+// name of a user or group id, NULL if it has none
+const char * idcache_user(const uid_t uid);
+
+const char * idcache_group(const gid_t gid);
+
+// id of a user or group name; returns 0 and fills in the id if the name is known, -1 otherwise
+int idcache_uid(const char * name, uid_t * uid);
+
+int idcache_gid(const char * name, gid_t * gid);
+
+#endif // IDCACHE_H_INCLUDED
@@ -3,7 +3,116 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <string.h>
 #include "tar.h"
+#include "stats.h"
+
+// print collected stats at the end of the run (0: off, 1: text, 2: JSON)
+static char stats = 0;
+
+// match search patterns as regular expressions
+static char regex = 0;
+
+// number of archives written by a sharded create (0: one per processor)
+static int shards = 0;
+
+// parse a byte count with an optional K, M or G suffix
+static unsigned long long parse_size(const char * str) {
+    char * end;
+    unsigned long long size = strtoull(str, &end, 10);
+    switch(*end) {
+        case 'G': case 'g':
+            size *= 1024;
+            /* fall through */
+        case 'M': case 'm':
+            size *= 1024;
+            /* fall through */
+        case 'K': case 'k':
+            size *= 1024;
+    }
+    return size;
+}
+
+// apply "--option" arguments following the command
+// returns index of the first file argument
+static int parse_options(int argc, char** argv, int first) {
+    while(first < argc && !strncmp(argv[first], "--", 2)) {
+        if(!strcmp(argv[first], "--digest")) {
+            tar_opts.digest = DIGEST_CRC32C;
+        }
+        else if(!strcmp(argv[first], "--io-uring")) {
+            tar_opts.uring = 1;
+        }
+        else if(!strcmp(argv[first], "--low-impact")) {
+            tar_opts.low_impact = 1;
+        }
+        else if(!strcmp(argv[first], "--direct")) {
+            tar_opts.direct = 1;
+        }
+        else if(!strncmp(argv[first], "--bwlimit=", 10)) {
+            tar_opts.bwlimit = parse_size(argv[first] + 10);
+        }
+        else if(!strncmp(argv[first], "--iops=", 7)) {
+            tar_opts.iops = strtoul(argv[first] + 7, NULL, 10);
+        }
+        else if(!strncmp(argv[first], "--exclude=", 10)) {
+            tar_opts.exclude = realloc(tar_opts.exclude, (tar_opts.exclude_count + 1) * sizeof(char *));
+            tar_opts.exclude[tar_opts.exclude_count++] = argv[first] + 10;
+        }
+        else if(!strncmp(argv[first], "--rename=", 9)) {
+            tar_opts.rename = realloc(tar_opts.rename, (tar_opts.rename_count + 1) * sizeof(char *));
+            tar_opts.rename[tar_opts.rename_count++] = argv[first] + 9;
+        }
+        else if(!strncmp(argv[first], "--owner=", 8)) {
+            tar_opts.owner = argv[first] + 8;
+        }
+        else if(!strncmp(argv[first], "--group=", 8)) {
+            tar_opts.group = argv[first] + 8;
+        }
+        else if(!strcmp(argv[first], "--format=gnu")) {
+            tar_opts.format = FORMAT_GNU;
+        }
+        else if(!strcmp(argv[first], "--format=pax")) {
+            tar_opts.format = FORMAT_PAX;
+        }
+        else if(!strncmp(argv[first], "--checkpoint=", 13)) {
+            tar_opts.checkpoint = argv[first] + 13;
+        }
+        else if(!strcmp(argv[first], "--resume")) {
+            tar_opts.resume = 1;
+        }
+        else if(!strcmp(argv[first], "--occurrence")) {
+            tar_opts.occurrence = 1;
+        }
+        else if(!strncmp(argv[first], "--shards=", 9)) {
+            shards = atoi(argv[first] + 9);
+        }
+        else if(!strcmp(argv[first], "--regex")) {
+            regex = 1;
+        }
+        else if(!strcmp(argv[first], "--stats")) {
+            stats = 1;
+        }
+        else if(!strcmp(argv[first], "--stats=json")) {
+            stats = 2;
+        }
+        else if(!strncmp(argv[first], "--trace=", 8)) {
+            stats = stats ? stats : 1;
+            tar_stats_enable(argv[first] + 8);
+        }
+        else {
+            fprintf(stderr, "Unknown option %s\n", argv[first]);
+        }
+        first++;
+    }
+
+    return first;
+}
+
+static int print_name(const int fd, struct tar_t * entry, void * arg) {
+    printf("%s\n", tar_entry_name(entry));
+    return 0;
+}
 
 int main(int argc, char** argv) {
    // char *buf =(char*)calloc(3500,sizeof(char));
@@ -14,26 +123,31 @@ int main(int argc, char** argv) {
     struct tar_t * archive = NULL;
     const char * filename[] = {"B-1.txt"};
 
-    if(argv[2][1] == 't') {
-        int cnt =  tar_read(fd,&archive, verbosity);
-
-        for(int i = 0; i < cnt; i++) {
-             printf("%s\n", archive->name);
-             archive = archive->next;
-        }
+    int first = parse_options(argc, argv, 3);
+    int status = 0;
+    if(stats && !tar_stats.enabled) {
+        tar_stats_enable(NULL);
+    }
+    const char ** files = (const char **) argv + first;
+    int filecount = argc - first;
 
+    // names may be given as wildcard patterns or directories
+    // listing stops reading as soon as every named file was found; extracting visits every copy
+    // of a name in archive order, so it leaves the newest one
+    if(argv[2][1] == 't') {
+        tar_walk_first(fd, filecount, files, print_name, NULL, verbosity);
     }
 
-    if(argv[2][1] == 'c') {
+    if(!strcmp(argv[2], "-c")) {
         const char * create[argc - 3];
         int cnt = argc, i = 0;
 
-        while(i < cnt - 3) {
-            create[i] = argv[3 + i];
+        while(i < cnt - first) {
+            create[i] = argv[first + i];
             i++;
         }
 
-        int fd1 = open(argv[1],O_CREAT | O_RDWR);
+        int fd1 = open(argv[1],O_CREAT | O_RDWR, 0644);
         tar_update(fd1, &archive,i,create,verbosity);
 
     }
@@ -46,19 +160,24 @@ int main(int argc, char** argv) {
 
 
     if(argv[2][1] == 'x') {
-        tar_read(fd,&archive, verbosity);
-        tar_extract(fd, archive, 6, filename, verbosity);
+        tar_extract_lazy(fd, filecount, files, verbosity);
     }
 
 
+    // member contents to stdout, e.g. to pipe one file into another program
+    // with --occurrence, the first copy of each name is written and reading stops once all were found
+    if(!strcmp(argv[2], "-O")) {
+        if(tar_stream(fd, filecount, files, STDOUT_FILENO, verbosity) < 0) {
+            status = 1;
+        }
+    }
+
     if(argv[2][1] == 'l' && argv[2][2] == 's') {
-        tar_read(fd,&archive, verbosity);
-        tar_ls(f, archive, 6, filename, verbosity);
+        tar_ls_lazy(fd, filecount, files, verbosity);
     }
 
     if(argv[2][1] == 'c' && argv[2][2] == 'a' && argv[2][3] == 't') {
-        tar_read(fd,&archive, verbosity);
-        print_tar_metadata(f, archive);
+        print_tar_metadata_lazy(fd, filecount, files, verbosity);
 
     }
 
@@ -68,12 +187,68 @@ int main(int argc, char** argv) {
 
     }
 
+    if(!strcmp(argv[2], "-verify")) {
+        tar_read(fd,&archive, verbosity);
+        if(tar_verify(fd, archive, sysconf(_SC_NPROCESSORS_ONLN), verbosity)) {
+            status = 1;
+        }
+    }
+
+    // -T OUTPUT [files]: copy members into another archive ("-" for stdout), renamed and re-owned on the way
+    if(!strcmp(argv[2], "-T") && filecount) {
+        int out = strcmp(files[0], "-") ? open(files[0], O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+        if(out < 0 || tar_transform(fd, out, filecount - 1, files + 1, verbosity) < 0) {
+            status = 1;
+        }
+    }
+
+    // -S files...: sharded create, -X [files]: parallel extraction of the shards (archive name is the shard base)
+    if(!strcmp(argv[2], "-S")) {
+        if(tar_write_shards(argv[1], shards ? shards : sysconf(_SC_NPROCESSORS_ONLN), filecount, files, verbosity) < 0) {
+            status = 1;
+        }
+    }
+
+    if(!strcmp(argv[2], "-X")) {
+        if(tar_extract_shards(argv[1], filecount, files, verbosity) < 0) {
+            status = 1;
+        }
+    }
+
+    // -A archives...: append the members of other archives
+    if(!strcmp(argv[2], "-A")) {
+        tar_read(fd,&archive, verbosity);
+        if(tar_concatenate(fd, &archive, filecount, files, verbosity) < 0) {
+            status = 1;
+        }
+    }
+
+    // -grep PATTERN [files]: where the pattern occurs inside members
+    if(!strcmp(argv[2], "-grep") && filecount) {
+        tar_read(fd,&archive, verbosity);
+        if(tar_search(fd, archive, filecount - 1, files + 1, files[0], regex, sysconf(_SC_NPROCESSORS_ONLN), verbosity) <= 0) {
+            status = 1;
+        }
+    }
+
+    // -serve: answer requests on the Unix socket named in place of the archive, -query FIELDS...: ask it
+    if(!strcmp(argv[2], "-serve")) {
+        status = tar_serve(argv[1], verbosity) < 0;
+    }
+
+    if(!strcmp(argv[2], "-query") && filecount) {
+        if(tar_query(argv[1], filecount, files, STDOUT_FILENO) < 0) {
+            status = 1;
+        }
+    }
+
     if(argv[2][1] == 'r') {
         tar_read(fd,&archive, verbosity);
-        tar_remove(fd, &archive, 1, filename, verbosity);
+        tar_remove(fd, &archive, filecount, files, verbosity);
     }
 
 
+    tar_stats_report(stderr, stats == 2);
 
-    return 0;
+    return status;
 }
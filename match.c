@@ -0,0 +1,221 @@
+#include "match.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include <fnmatch.h>
+
+int matcher_init(struct matcher * m){
+    memset(m, 0, sizeof(struct matcher));
+    m -> nodes = 1;
+    m -> literal = 1;
+    return 0;
+}
+
+// child of parent for a component, created if it does not exist yet
+static struct match_node * match_child(struct matcher * m, struct match_node * parent, const char * part, const size_t len){
+    const char any = (len == 2) && !strncmp(part, "**", 2);
+    struct match_node ** tail = &parent -> child;
+    for(; *tail; tail = &(*tail) -> next){
+        if (any?!(*tail) -> part:((*tail) -> part && !strncmp((*tail) -> part, part, len) && !(*tail) -> part[len])){
+            return *tail;
+        }
+    }
+
+    struct match_node * node = calloc(1, sizeof(struct match_node));
+    if (!node){
+        return NULL;
+    }
+
+    if (!any){
+        if (!(node -> part = strndup(part, len))){
+            free(node);
+            return NULL;
+        }
+        node -> glob = !!strpbrk(node -> part, "*?[");
+    }
+
+    *tail = node;
+    m -> nodes++;
+    return node;
+}
+
+// same forms as archive names: no leading "/" or "./", no trailing '/'
+static const char * match_trim(const char * pattern, size_t * len){
+    while ((*pattern == '/') || ((pattern[0] == '.') && (pattern[1] == '/'))){
+        pattern += (*pattern == '/')?1:2;
+    }
+
+    *len = strlen(pattern);
+    while (*len && (pattern[*len - 1] == '/')){
+        (*len)--;
+    }
+    return pattern;
+}
+
+int matcher_add(struct matcher * m, const char * pattern, const char type){
+    size_t len;
+    pattern = match_trim(pattern, &len);
+
+    struct match_node * node = &m -> root;
+
+    // bare exclude patterns may match at any depth
+    if ((type == MATCH_EXCLUDE) && !memchr(pattern, '/', len)){
+        if (!(node = match_child(m, node, "**", 2))){
+            return -1;
+        }
+    }
+
+    for(size_t i = 0; i < len;){
+        size_t end = i;
+        while ((end < len) && (pattern[end] != '/')){
+            end++;
+        }
+
+        // empty and "." components do not change a path
+        if ((end > i) && !((end - i == 1) && (pattern[i] == '.'))){
+            if (!(node = match_child(m, node, pattern + i, end - i))){
+                return -1;
+            }
+        }
+        i = end + 1;
+    }
+
+    if (type == MATCH_EXCLUDE){
+        node -> accept |= MATCH_EXCLUDE;
+        m -> excludes = 1;
+        return 0;
+    }
+
+    char ** patterns = realloc(m -> patterns, (m -> includes + 1) * sizeof(char *));
+    if (!patterns){
+        return -1;
+    }
+    m -> patterns = patterns;
+
+    int * same = realloc(m -> same, (m -> includes + 1) * sizeof(int));
+    if (!same){
+        return -1;
+    }
+    m -> same = same;
+    m -> same[m -> includes] = 0;
+
+    if (!(m -> patterns[m -> includes] = strndup(pattern, len))){
+        return -1;
+    }
+
+    if (strpbrk(m -> patterns[m -> includes], "*?[")){
+        m -> literal = 0;
+    }
+
+    m -> includes++;
+
+    // repeated patterns are chained to the first one, so each of them is seen
+    if (!node -> index){
+        node -> index = m -> includes;
+    }
+    else{
+        int last = node -> index;
+        while (m -> same[last - 1]){
+            last = m -> same[last - 1];
+        }
+        m -> same[last - 1] = m -> includes;
+    }
+    node -> accept |= MATCH_INCLUDE;
+
+    return 0;
+}
+
+// add a node and the "**" nodes that can follow it without consuming a component
+static void match_activate(const struct match_node ** active, int * count, const struct match_node * node){
+    for(int i = 0; i < *count; i++){
+        if (active[i] == node){
+            return;
+        }
+    }
+    active[(*count)++] = node;
+
+    for(const struct match_node * child = node -> child; child; child = child -> next){
+        if (!child -> part){
+            match_activate(active, count, child);
+        }
+    }
+}
+
+// all patterns advance together over the components of name, so each name is matched in one pass
+int matcher_match(const struct matcher * m, const char * name, char * seen){
+    const size_t len = strlen(name);
+    char buf[len + 1];
+    memcpy(buf, name, len + 1);
+
+    const struct match_node * sets[2][m -> nodes];
+    const struct match_node ** active = sets[0], ** next = sets[1];
+    int count = 0;
+    char accepted = 0;
+
+    match_activate(active, &count, &m -> root);
+
+    for(char * part = buf; part && count;){
+        char * end = strchr(part, '/');
+        if (end){
+            *end = '\0';
+        }
+
+        if (*part && strcmp(part, ".")){
+            int n = 0;
+            for(int i = 0; i < count; i++){
+                if (!active[i] -> part){
+                    match_activate(next, &n, active[i]);
+                }
+                for(const struct match_node * child = active[i] -> child; child; child = child -> next){
+                    if (child -> part && (child -> glob?!fnmatch(child -> part, part, 0):!strcmp(child -> part, part))){
+                        match_activate(next, &n, child);
+                    }
+                }
+            }
+
+            const struct match_node ** swap = active;
+            active = next;
+            next = swap;
+            count = n;
+
+            // a pattern matching a directory matches everything below it
+            for(int i = 0; i < count; i++){
+                accepted |= active[i] -> accept;
+                for(int index = seen?active[i] -> index:0; index; index = m -> same[index - 1]){
+                    seen[index - 1] = 1;
+                }
+            }
+
+            if (accepted & MATCH_EXCLUDE){
+                return -1;
+            }
+        }
+
+        part = end?(end + 1):NULL;
+    }
+
+    if (m -> includes && !(accepted & MATCH_INCLUDE)){
+        return -1;
+    }
+    return 1;
+}
+
+static void match_free(struct match_node * node){
+    while (node){
+        struct match_node * next = node -> next;
+        match_free(node -> child);
+        free(node -> part);
+        free(node);
+        node = next;
+    }
+}
+
+void matcher_free(struct matcher * m){
+    match_free(m -> root.child);
+    for(int i = 0; i < m -> includes; i++){
+        free(m -> patterns[i]);
+    }
+    free(m -> patterns);
+    free(m -> same);
+    matcher_init(m);
+}
@@ -0,0 +1,43 @@
+#ifndef MATCH_H_INCLUDED
+#define MATCH_H_INCLUDED
+
+// include and exclude patterns compiled into a single trie of path components
+// components may use shell wildcards (*, ?, [...]) and "**" stands for any number of components
+// a pattern matches a name and everything below it, so selecting a directory selects its contents
+// exclude patterns without a '/' match at any depth ("node_modules", "*.o")
+
+#define MATCH_INCLUDE    1
+#define MATCH_EXCLUDE    2
+
+struct match_node {
+    char * part;                            // component; NULL for "**"
+    char glob;                              // part has wildcards
+    char accept;                            // MATCH_INCLUDE and/or MATCH_EXCLUDE if patterns end here
+    int index;                              // index + 1 of the include pattern ending here
+    struct match_node * child;              // first child
+    struct match_node * next;               // next sibling
+};
+
+struct matcher {
+    struct match_node root;
+    int nodes;                              // number of nodes; bounds the set of active nodes
+    int includes;                           // number of include patterns
+    char ** patterns;                       // include patterns as added (without "./" and trailing '/')
+    int * same;                             // index + 1 of the next include pattern ending at the same node as pattern i
+    char literal;                           // no include pattern has wildcards
+    char excludes;                          // some exclude pattern was added
+};
+
+int matcher_init(struct matcher * m);
+
+// add a pattern of the given type (MATCH_INCLUDE or MATCH_EXCLUDE)
+// include patterns are numbered in the order they are added
+int matcher_add(struct matcher * m, const char * pattern, const char type);
+
+// returns -1 if name is excluded, or not selected by any include pattern, and 1 otherwise
+// if seen is given, seen[i] is set for every include pattern i that selects name
+int matcher_match(const struct matcher * m, const char * name, char * seen);
+
+void matcher_free(struct matcher * m);
+
+#endif // MATCH_H_INCLUDED
@@ -0,0 +1,159 @@
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+struct stats tar_stats;
+
+static const char * counter_names[STAT_COUNTERS] = { "read_calls", "write_calls", "seek_calls", "bytes_read", "bytes_written", "entries" };
+static const char * latency_names[LAT_COUNT] = { "stat", "open", "mkdir" };
+static const char * phase_names[PHASE_COUNT] = { "read", "write", "extract", "remove", "diff" };
+
+// trace events come from several threads
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t trace_origin;
+static char trace_first = 1;
+static int thread_count;
+static __thread int thread_id;
+
+uint64_t stats_clock(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int tar_stats_enable(const char * trace_path){
+    memset(&tar_stats, 0, sizeof(struct stats));
+
+    if (trace_path){
+        tar_stats.trace = fopen(trace_path, "w");
+        if (!tar_stats.trace){
+            fprintf(stderr, "Error: Unable to open %s: %s\n", trace_path, strerror(errno));
+            return -1;
+        }
+        trace_origin = stats_clock();
+        fprintf(tar_stats.trace, "[");
+    }
+
+    tar_stats.enabled = 1;
+    return 0;
+}
+
+void stats_trace(const char * name, const uint64_t start, const uint64_t end){
+    if (!tar_stats.trace){
+        return;
+    }
+
+    if (!thread_id){
+        thread_id = __atomic_add_fetch(&thread_count, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    fprintf(tar_stats.trace, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+            trace_first?"":",", name, thread_id, (start - trace_origin) / 1e3, (end - start) / 1e3);
+    trace_first = 0;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void stats_record(const enum stats_latency which, const uint64_t start){
+    if (!tar_stats.enabled){
+        return;
+    }
+
+    const uint64_t end = stats_clock();
+    const uint64_t ns = end - start;
+
+    // bucket i holds calls shorter than 2^i microseconds
+    int bucket = 0;
+    for(uint64_t us = ns / 1000; us && (bucket < STATS_BUCKETS - 1); us >>= 1){
+        bucket++;
+    }
+
+    __atomic_fetch_add(&tar_stats.calls[which], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&tar_stats.latency_ns[which], ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&tar_stats.histogram[which][bucket], 1, __ATOMIC_RELAXED);
+    stats_trace(latency_names[which], start, end);
+}
+
+void stats_span_end(struct stats_span * span){
+    if (!tar_stats.enabled || !span -> start){
+        return;
+    }
+
+    const uint64_t end = stats_clock();
+    __atomic_fetch_add(&tar_stats.phase_ns[span -> phase], end - span -> start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&tar_stats.phase_calls[span -> phase], 1, __ATOMIC_RELAXED);
+    stats_trace(phase_names[span -> phase], span -> start, end);
+}
+
+static void report_text(FILE * f){
+    fprintf(f, "--- stats ---\n");
+    for(int i = 0; i < STAT_COUNTERS; i++){
+        fprintf(f, "%-14s %llu\n", counter_names[i], (unsigned long long) tar_stats.counters[i]);
+    }
+
+    for(int i = 0; i < PHASE_COUNT; i++){
+        if (tar_stats.phase_calls[i]){
+            fprintf(f, "phase %-8s %10.3f ms (%llu calls)\n", phase_names[i], tar_stats.phase_ns[i] / 1e6, (unsigned long long) tar_stats.phase_calls[i]);
+        }
+    }
+
+    for(int i = 0; i < LAT_COUNT; i++){
+        if (!tar_stats.calls[i]){
+            continue;
+        }
+
+        fprintf(f, "%-6s %llu calls, avg %.1f us\n", latency_names[i], (unsigned long long) tar_stats.calls[i],
+                tar_stats.latency_ns[i] / 1e3 / tar_stats.calls[i]);
+        for(int b = 0; b < STATS_BUCKETS; b++){
+            if (tar_stats.histogram[i][b]){
+                fprintf(f, "    < %8llu us: %llu\n", 1ULL << b, (unsigned long long) tar_stats.histogram[i][b]);
+            }
+        }
+    }
+}
+
+static void report_json(FILE * f){
+    fprintf(f, "{\"counters\": {");
+    for(int i = 0; i < STAT_COUNTERS; i++){
+        fprintf(f, "%s\"%s\": %llu", i?", ":"", counter_names[i], (unsigned long long) tar_stats.counters[i]);
+    }
+
+    fprintf(f, "}, \"phases_ms\": {");
+    for(int i = 0; i < PHASE_COUNT; i++){
+        fprintf(f, "%s\"%s\": %.3f", i?", ":"", phase_names[i], tar_stats.phase_ns[i] / 1e6);
+    }
+
+    fprintf(f, "}, \"latency\": {");
+    for(int i = 0; i < LAT_COUNT; i++){
+        fprintf(f, "%s\"%s\": {\"calls\": %llu, \"total_ms\": %.3f, \"histogram_us\": [", i?", ":"", latency_names[i],
+                (unsigned long long) tar_stats.calls[i], tar_stats.latency_ns[i] / 1e6);
+        for(int b = 0; b < STATS_BUCKETS; b++){
+            fprintf(f, "%s%llu", b?", ":"", (unsigned long long) tar_stats.histogram[i][b]);
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "}}\n");
+}
+
+void tar_stats_report(FILE * f, const char json){
+    if (!tar_stats.enabled){
+        return;
+    }
+
+    if (json){
+        report_json(f);
+    }
+    else{
+        report_text(f);
+    }
+
+    if (tar_stats.trace){
+        fprintf(tar_stats.trace, "\n]\n");
+        fclose(tar_stats.trace);
+        tar_stats.trace = NULL;
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef STATS_H_INCLUDED
+#define STATS_H_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// counters kept while stats are enabled
+enum stats_counter {
+    STAT_READS,                             // read() and pread() calls
+    STAT_WRITES,                            // write() and pwrite() calls
+    STAT_SEEKS,                             // lseek() calls
+    STAT_BYTES_READ,
+    STAT_BYTES_WRITTEN,
+    STAT_ENTRIES,                           // entries written or extracted
+    STAT_COUNTERS
+};
+
+// calls with latency histograms
+enum stats_latency {
+    LAT_STAT,
+    LAT_OPEN,
+    LAT_MKDIR,
+    LAT_COUNT
+};
+
+// phases with wall clock totals; phases may nest (a lazy extract also reads)
+enum stats_phase {
+    PHASE_READ,                             // tar_read / tar_walk
+    PHASE_WRITE,                            // tar_write / write_entries
+    PHASE_EXTRACT,                          // tar_extract / extract_entry
+    PHASE_REMOVE,                           // tar_remove
+    PHASE_DIFF,                             // tar_diff
+    PHASE_COUNT
+};
+
+// latency buckets are powers of two microseconds
+#define STATS_BUCKETS 24
+
+struct stats {
+    char enabled;
+    uint64_t counters[STAT_COUNTERS];
+    uint64_t calls[LAT_COUNT];
+    uint64_t latency_ns[LAT_COUNT];
+    uint64_t histogram[LAT_COUNT][STATS_BUCKETS];
+    uint64_t phase_ns[PHASE_COUNT];
+    uint64_t phase_calls[PHASE_COUNT];
+    FILE * trace;                           // chrome trace output (optional)
+};
+
+extern struct stats tar_stats;
+
+// start collecting; trace_path may be NULL
+int tar_stats_enable(const char * trace_path);
+
+// print collected stats as text or JSON and close the trace
+void tar_stats_report(FILE * f, const char json);
+
+uint64_t stats_clock(void);
+
+void stats_record(const enum stats_latency which, const uint64_t start);
+
+void stats_trace(const char * name, const uint64_t start, const uint64_t end);
+
+static inline void stats_add(const enum stats_counter which, const uint64_t value){
+    if (tar_stats.enabled){
+        __atomic_fetch_add(&tar_stats.counters[which], value, __ATOMIC_RELAXED);
+    }
+}
+
+static inline uint64_t stats_start(void){
+    return tar_stats.enabled?stats_clock():0;
+}
+
+// time a call and add it to a latency histogram, evaluates to the call's result
+#define STATS_TIME(which, call) ({ const uint64_t stats_begin_ = stats_start(); __typeof__(call) stats_rc_ = (call); stats_record(which, stats_begin_); stats_rc_; })
+
+static inline off_t stats_lseek(int fd, off_t offset, int whence){
+    stats_add(STAT_SEEKS, 1);
+    return lseek(fd, offset, whence);
+}
+
+static inline int stats_stat(const char * path, struct stat * st){
+    return STATS_TIME(LAT_STAT, stat(path, st));
+}
+
+// phase that ends when the enclosing scope is left
+struct stats_span {
+    enum stats_phase phase;
+    uint64_t start;
+};
+
+static inline struct stats_span stats_span_begin(const enum stats_phase phase){
+    struct stats_span span = { phase, stats_start() };
+    return span;
+}
+
+void stats_span_end(struct stats_span * span);
+
+#define STATS_PHASE(phase) struct stats_span stats_span_ __attribute__((cleanup(stats_span_end))) = stats_span_begin(phase)
+
+#endif // STATS_H_INCLUDED
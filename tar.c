@@ -1,4 +1,9 @@
+#define _GNU_SOURCE
 #include "tar.h"
+#include "idcache.h"
+#include "match.h"
+#include "stats.h"
+#include "uring.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -7,10 +12,24 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <ctype.h>
+#include <errno.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <stdint.h>
 #include <string.h>
 
 #include <dirent.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 // only print in verbose mode
@@ -20,1010 +39,4772 @@
 // capture errno when erroring
 #define RC_ERROR(fmt, ...) const int rc = errno; ERROR(fmt, ##__VA_ARGS__); return -1;
 
+struct tar_options tar_opts = { DIGEST_NONE, 0, 0, 0, 0, 0, FORMAT_PAX, NULL, 0, NULL, 0, NULL, NULL, NULL, 0, 0 };
+
+#ifdef _WIN32
+#define MKDIR(path, mode) mkdir(path)
+#else
+#define MKDIR(path, mode) mkdir(path, mode)
+#endif
+
+// FNV-1a hash of an entry name
+static unsigned int name_hash(const char * name, const size_t len){
+    unsigned int hash = 2166136261u;
+    for(size_t i = 0; i < len; i++){
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    }
+    return hash;
+}
 
 
 // convert octal string to unsigned integer
 unsigned int oct2uint(char * oct, unsigned int size){
-    unsigned int out = 0;
-    int i = 0;
-    while ((i < size) && oct[i])
-        out = (out << 3) | (unsigned int) (oct[i++] - '0');
+    return tar_octal_decode(oct, size);
+}
+
+int tar_header_layout(const struct tar_t * entry){
+    if (!memcmp(entry -> ustar, "ustar  ", 8)){
+        return HEADER_GNU;
+    }
+    return memcmp(entry -> ustar, "ustar", 6)?HEADER_V7:HEADER_USTAR;
+}
+
+// throttle state shared by all threads
+static pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t throttle_next;              // monotonic time (ns) at which the next operation may start
+
+// move the next slot back by the time cost of an operation; returns how long to wait before it
+static uint64_t throttle_charge(const int size, const char operation){
+    uint64_t cost = 0;
+    if (tar_opts.bwlimit){
+        cost = (uint64_t) size * 1000000000ull / tar_opts.bwlimit;
+    }
+    if (tar_opts.iops && operation){
+        cost = MAX(cost, 1000000000ull / tar_opts.iops);
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    const uint64_t now = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+    pthread_mutex_lock(&throttle_lock);
+    if (throttle_next < now){
+        throttle_next = now;
+    }
+    const uint64_t wait = throttle_next - now;
+    throttle_next += cost;
+    pthread_mutex_unlock(&throttle_lock);
 
-    return out;
+    return wait;
+}
+
+// wait for a slot under the bytes/s and IOPS limits before an operation of the given size
+static void throttle(const int size){
+    if (!tar_opts.bwlimit && !tar_opts.iops){
+        return;
+    }
+
+    const uint64_t wait = throttle_charge(size, 1);
+    if (wait){
+        struct timespec ts;
+        ts.tv_sec = wait / 1000000000ull;
+        ts.tv_nsec = wait % 1000000000ull;
+        while (nanosleep(&ts, &ts) && (errno == EINTR));
+    }
+}
+
+// reads are charged for the bytes they return, which can be far less than asked for at the end of a file
+static void throttle_read(const int got){
+    if (tar_opts.bwlimit){
+        throttle_charge(got, 0);
+    }
 }
 
 // force read() to complete
 int read_size(int fd, char * buf, int size){
-    int got = 0, rd;
-    while ((got < size) && ((rd = read(fd, buf + got, size - got)) > 0)){
+    throttle(0);
+    int got = 0, rd, calls = 0;
+    while ((got < size) && (calls++, (rd = read(fd, buf + got, size - got)) > 0)){
         got += rd;
     }
+    throttle_read(got);
+    stats_add(STAT_READS, calls);
+    stats_add(STAT_BYTES_READ, got);
     return got;
 }
 
 
 int write_size(int fd, char * buf, int size){
-    int wrote = 0, rc;
-    while ((wrote < size) && ((rc = write(fd, buf + wrote, size - wrote)) > 0)){
+    throttle(size);
+    int wrote = 0, rc, calls = 0;
+    while ((wrote < size) && (calls++, (rc = write(fd, buf + wrote, size - wrote)) > 0)){
         wrote += rc;
     }
+    stats_add(STAT_WRITES, calls);
+    stats_add(STAT_BYTES_WRITTEN, wrote);
     return wrote;
 }
 
-// check if a buffer is zeroed
-int iszeroed(char * buf, size_t size){
-    for(size_t i = 0; i < size; buf++, i++){
-        if (* (char *) buf){
-            return 0;
-        }
-    }
-    return 1;
-}
-
-// recursive freeing of entries
-void tar_free(struct tar_t * archive){
-    while (archive){
-        struct tar_t * next = archive -> next;
-        free(archive);
-        archive = next;
+// force pread() to complete
+int pread_size(int fd, char * buf, int size, off_t offset){
+    throttle(0);
+    int got = 0, rd, calls = 0;
+    while ((got < size) && (calls++, (rd = pread(fd, buf + got, size - got, offset + got)) > 0)){
+        got += rd;
     }
+    throttle_read(got);
+    stats_add(STAT_READS, calls);
+    stats_add(STAT_BYTES_READ, got);
+    return got;
 }
 
+// small members are gathered here while an archive is written, and reach it in large writes
+#define COALESCE_SIZE (1024 * 1024)
 
+// writes this large go to the archive directly
+#define COALESCE_WRITE_MAX (64 * 1024)
 
-// read a tar file
-// archive should be address to null pointer
-int tar_read(const int fd, struct tar_t ** archive, const char verbosity){
-    if (fd < 0){                //fd is always > 0
-        ERROR("Bad file descriptor");
-    }
-    //if archive is NOT NULL
-    if (!archive || *archive){
-        ERROR("Bad archive");
-    }
-
-    unsigned int offset = 0;   //distance between beginning and given object
-    int count = 0;
+struct coalesce {
+    int fd;
+    off_t at;                               // archive offset of data[0]
+    size_t used;
+    char * data;                            // COALESCE_SIZE bytes
+};
 
-    struct tar_t ** tar = archive;
-    char update = 1;
+// gathered data of the archive being written on this thread (NULL: writes go straight out)
+static __thread struct coalesce * coalescing;
 
-    for(count = 0; ; count++){
-        *tar = malloc(sizeof(struct tar_t));
-        if (update && (read_size(fd, (*tar) -> block, 512) != 512)){
-            V_PRINT(stderr, "Error: Bad read. Stopping");
-            tar_free(*tar);
-            *tar = NULL;
-            break;
-        }
+// write out what was gathered
+static int coalesce_flush(void){
+    struct coalesce * c = coalescing;
+    if (!c || !c -> used){
+        return 0;
+    }
 
-        update = 1;
-        // if current block is all zeros
-        if (iszeroed((*tar) -> block, 512)){
-            if (read_size(fd, (*tar) -> block, 512) != 512){
-                V_PRINT(stderr, "Error: Bad read. Stopping");
-                tar_free(*tar);
-                *tar = NULL;
-                break;
-            }
+    const size_t used = c -> used;
+    c -> at += used;
+    c -> used = 0;
+    return (write_size(c -> fd, c -> data, used) == (int) used)?0:-1;
+}
 
-            // check if next block is all zeros as well
-            if (iszeroed((*tar) -> block, 512)){
-                tar_free(*tar);
-                *tar = NULL;
+// room for size bytes (at most COALESCE_WRITE_MAX) after the gathered data; NULL if writing out failed
+static char * coalesce_reserve(const size_t size){
+    struct coalesce * c = coalescing;
+    if ((c -> used + size > COALESCE_SIZE) && (coalesce_flush() < 0)){
+        return NULL;
+    }
 
-                // skip to end of record
-                if (lseek(fd, RECORDSIZE - (offset % RECORDSIZE), SEEK_CUR) == (off_t) (-1)){
-                    RC_ERROR("Unable to seek file: %s", strerror(rc));
-                }
+    char * at = c -> data + c -> used;
+    c -> used += size;
+    return at;
+}
 
-                break;
-            }
+// write_size() for archive data, which is gathered while the archive is being written
+static int archive_write(const int fd, const char * buf, const int size){
+    struct coalesce * c = coalescing;
+    if (!c || (c -> fd != fd)){
+        return write_size(fd, (char *) buf, size);
+    }
 
-            update = 0;
+    if (size > COALESCE_WRITE_MAX){
+        if (coalesce_flush() < 0){
+            return -1;
         }
+        const int wrote = write_size(fd, (char *) buf, size);
+        c -> at += wrote;
+        return wrote;
+    }
 
-        // set current entry's file offset
-        (*tar) -> begin = offset;
+    char * at = coalesce_reserve(size);
+    if (!at){
+        return -1;
+    }
+    memcpy(at, buf, size);
+    return size;
+}
 
-        // skip over data and unfilled block
-        unsigned int jump = oct2uint((*tar) -> size, 11);
-        if (jump % 512){
-            jump += 512 - (jump % 512);
+// pwrite() into archive data written earlier, which may still be gathered
+static int archive_pwrite(const int fd, const char * buf, const int size, const off_t offset){
+    struct coalesce * c = coalescing;
+    if (c && (c -> fd == fd) && (offset + size > c -> at)){
+        if (offset >= c -> at){
+            memcpy(c -> data + (offset - c -> at), buf, size);
+            return size;
         }
 
-        // move file descriptor
-
-        offset += 512 + jump;
-        if (lseek(fd, jump, SEEK_CUR) == (off_t) (-1)){
-            RC_ERROR("Unable to seek file: %s", strerror(rc));
+        // partly written out already
+        if (coalesce_flush() < 0){
+            return -1;
         }
-
-        // ready next value
-
-        tar = &((*tar) -> next);
     }
 
-    return count;
+    stats_add(STAT_WRITES, 1);
+    return pwrite(fd, buf, size, offset);
 }
 
+// checkpoints are taken at most once per this much data or time
+#define CHECKPOINT_BYTES (64 * 1024 * 1024)
+#define CHECKPOINT_SECONDS 10
+
+// checkpoint file of the job running on this thread (NULL: none) and where its last checkpoint was
+static __thread const char * checkpoint_path;
+static __thread off_t checkpoint_offset;
+static __thread struct timespec checkpoint_time;
+
+// offset recorded by the last checkpoint of an interrupted job; 0 if there is none
+static off_t checkpoint_load(const char * path){
+    long long offset = 0;
+    FILE * f = fopen(path, "r");
+    if (f){
+        if (fscanf(f, "%lld", &offset) != 1){
+            offset = 0;
+        }
+        fclose(f);
+    }
+    return offset;
+}
 
+static void checkpoint_begin(const char * path, const off_t offset){
+    checkpoint_path = path;
+    checkpoint_offset = offset;
+    clock_gettime(CLOCK_MONOTONIC, &checkpoint_time);
+}
 
+// record that everything before offset is complete, if a checkpoint is due
+// the data is made durable first (fd when writing an archive, the file system when extracting with fd < 0),
+// and the record is replaced atomically, so it never points past what survives a crash
+static int checkpoint_save(const int fd, const off_t offset, const char * name){
+    if (!checkpoint_path){
+        return 0;
+    }
 
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((offset - checkpoint_offset < CHECKPOINT_BYTES) && (now.tv_sec - checkpoint_time.tv_sec < CHECKPOINT_SECONDS)){
+        return 0;
+    }
+    checkpoint_offset = offset;
+    checkpoint_time = now;
 
-struct tar_t * exists(struct tar_t * archive, const char * filename, const char ori){
-    while (archive){
-        if (ori){
-            if (!strncmp(archive -> original_name, filename, MAX(strlen(archive -> original_name), strlen(filename)) + 1)){
-                return archive;
-            }
+    if (fd >= 0){
+        if (coalesce_flush() < 0){
+            return -1;
         }
-        else{
-            if (!strncmp(archive -> name, filename, MAX(strlen(archive -> name), strlen(filename)) + 1)){
-                return archive;
-            }
+        fdatasync(fd);
+    }
+    else{
+#ifdef __linux__
+        const int dir = open(".", O_RDONLY | O_DIRECTORY);
+        if (dir >= 0){
+            syncfs(dir);
+            close(dir);
         }
-        archive = archive -> next;
+#else
+        sync();
+#endif
     }
-    return NULL;
-}
 
-int print_tar_metadata(FILE * f, struct tar_t * archive){
-    while (archive){
-        print_entry_metadata(f, archive);
-        archive = archive -> next;
+    char tmp[strlen(checkpoint_path) + 5];
+    sprintf(tmp, "%s.tmp", checkpoint_path);
+    FILE * f = fopen(tmp, "w");
+    if (!f){
+        return -1;
+    }
+    fprintf(f, "%lld %s\n", (long long) offset, name);
+    const int rc = (fflush(f) || fsync(fileno(f)))?-1:0;
+    if (fclose(f) || rc || rename(tmp, checkpoint_path)){
+        unlink(tmp);
+        return -1;
     }
 
-    return 0;
+    return 1;
 }
 
-int print_entry_metadata(FILE * f, struct tar_t * entry){
-    if (!entry){
-        return -1;
+// the job completed; nothing is left to resume
+static void checkpoint_end(void){
+    if (checkpoint_path){
+        unlink(checkpoint_path);
     }
+    checkpoint_path = NULL;
+}
 
-    time_t mtime = oct2uint(entry -> mtime, 12);
-    char mtime_str[32];
-    strftime(mtime_str, sizeof(mtime_str), "%c", localtime(&mtime));
-    printf( "File Name: %s\n", entry -> name);
-    printf( "Owner UID: %s (%d)\n", entry -> uid, oct2uint(entry -> uid, 12));
-    printf( "Owner GID: %s (%d)\n", entry -> gid, oct2uint(entry -> gid, 12));
-    printf( "File Mode: %s (%03o)\n", entry -> mode, oct2uint(entry -> mode, 8));
-    printf( "File Size: %s (%d)\n", entry -> size, oct2uint(entry -> size, 12));
-    printf( "Time     : %s (%s)\n", entry -> mtime, mtime_str);
-    printf( "Checksum : %s\n", entry -> check);
-    printf( "File Type: ");
-    switch (entry -> type){
-        case REGULAR: case NORMAL:
-            printf( "Normal File");
-            break;
-        case HARDLINK:
-            printf( "Hard Link");
-            break;
-        case SYMLINK:
-            printf( "Symbolic Link");
-            break;
-        case CHAR:
-            printf( "Character Special");
-            break;
-        case BLOCK:
-            printf( "Block Special");
-            break;
-        case DIRECTORY:
-            printf( "Directory");
-            break;
-        case FIFO:
-            printf("FIFO");
-            break;
-        case CONTIGUOUS:
-            printf( "Contiguous File");
-            break;
+// CRC32C lookup tables for the software fallback (slicing by 8)
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void){
+    for(uint32_t i = 0; i < 256; i++){
+        uint32_t crc = i;
+        for(int j = 0; j < 8; j++){
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        }
+        crc32c_table[0][i] = crc;
     }
 
-    printf("\n\n");
-    return 0;
+    for(uint32_t i = 0; i < 256; i++){
+        for(int j = 1; j < 8; j++){
+            crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+        }
+    }
 }
 
-// ls command
-int tar_ls(FILE * f, struct tar_t * archive, int filecount, const char * files[], const char verbosity){
-    if (!verbosity){
-        return 0;
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char * buf, size_t size){
+    while (size && ((uintptr_t) buf & 7)){
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf++) & 0xff];
+        size--;
     }
 
-    if (filecount && !files){
-        ERROR("Non-zero file count provided, but file list is NULL");
+    while (size >= 8){
+        uint32_t lo, hi;
+        memcpy(&lo, buf, 4);
+        memcpy(&hi, buf + 4, 4);
+        lo ^= crc;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        buf += 8;
+        size -= 8;
     }
 
+    while (size--){
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf++) & 0xff];
+    }
+    return crc;
+}
 
-    while (archive){
-        if (ls_entry(f, archive, filecount, files, verbosity) < 0){
-            return -1;
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
 
-        }
-        archive = archive -> next;
+// SSE4.2 has a dedicated CRC32C instruction
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char * buf, size_t size){
+    while (size && ((uintptr_t) buf & 7)){
+        crc = _mm_crc32_u8(crc, *buf++);
+        size--;
     }
 
-    return 0;
-}
-
+    uint64_t crc64 = crc;
+    while (size >= 8){
+        uint64_t v;
+        memcpy(&v, buf, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+        buf += 8;
+        size -= 8;
+    }
+    crc = (uint32_t) crc64;
 
-int ls_entry(FILE * f, struct tar_t * entry, int filecount, const char * files[], const char verbosity){
-    if (!verbosity){
-        return 0;
+    while (size--){
+        crc = _mm_crc32_u8(crc, *buf++);
     }
+    return crc;
+}
+#endif
 
-    if (filecount && !files){
-        V_PRINT(stderr, "Error: Non-zero file count given but no files given");
-        return -1;
+unsigned int tar_crc32c(unsigned int crc, const char * buf, size_t size){
+    crc = ~crc;
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("sse4.2")){
+        return ~crc32c_hw(crc, (const unsigned char *) buf, size);
     }
+#endif
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_sw(crc, (const unsigned char *) buf, size);
+}
 
-    // figure out whether or not to print
-    // if no files were specified, print everything
-    char print = !filecount;
-    // otherwise, search for matching names
-    for(int i = 0; i < filecount; i++){
-        if (strncmp(entry -> name, files[i], MAX(strlen(entry -> name), strlen(files[i])))){
-            print = 1;
-            break;
+// check if a buffer is zeroed
+int iszeroed(char * buf, size_t size){
+    for(size_t i = 0; i < size; buf++, i++){
+        if (* (char *) buf){
+            return 0;
         }
     }
+    return 1;
+}
 
-    if (print){
-        if (verbosity > 1){
-
-            const mode_t mode = oct2uint(entry -> mode, 7);
-            const char mode_str[26] = { "-hlcbdp-"[entry -> type?entry -> type - '0':0],
-                                        mode & S_IRUSR?'r':'-',
-                                        mode & S_IWUSR?'w':'-',
-                                        mode & S_IXUSR?'x':'-',
-//                                        mode & S_IRGRP?'r':'-',
-//                                        mode & S_IWGRP?'w':'-',
-//                                        mode & S_IXGRP?'x':'-',
-//                                        mode & S_IROTH?'r':'-',
-//                                        mode & S_IWOTH?'w':'-',
-//                                        mode & S_IXOTH?'x':'-',
-                                        0};
-            printf("%s %s/%s ", mode_str, entry -> gid, entry -> uid);
-            char size_buf[22] = {0};
-            int rc = -1;
-            switch (entry -> type){
-                case REGULAR: case NORMAL: case CONTIGUOUS:
-                    rc = sprintf(size_buf, "%u", oct2uint(entry -> size, 11));
-                    break;
-                case HARDLINK: case SYMLINK: case DIRECTORY: case FIFO:
-                    rc = sprintf(size_buf, "%u", oct2uint(entry -> size, 11));
-                    break;
+// recursive freeing of entries
+void tar_free(struct tar_t * archive){
+    while (archive){
+        struct tar_t * next = archive -> next;
+        free(archive);
+        archive = next;
+    }
+}
 
-            }
 
-            if (rc < 0){
-                ERROR("Failed to write length");
-            }
 
-            printf("%s", size_buf);
+// copy a name from an extended header, cutting it at TAR_PATH_MAX
+static char * long_copy(char * dst, const char * src, size_t len){
+    len = MIN(len, TAR_PATH_MAX - 1);
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+    return dst;
+}
 
-            time_t mtime = oct2uint(entry -> mtime, 11);
-            struct tm * time = localtime(&mtime);
-            printf(" %d-%02d-%02d %02d:%02d ", time -> tm_year + 1900, time -> tm_mon + 1, time -> tm_mday, time -> tm_hour, time -> tm_min);
+// apply the records of a PAX extended header to the entry that follows it
+// records need not be NUL terminated; nothing past size is read
+static void pax_parse(struct tar_t * entry, const char * records, const unsigned int size, struct tar_names * names){
+    unsigned int pos = 0;
+    while (pos < size){
+        // each record is "<length> <keyword>=<value>\n" where length includes itself
+        unsigned long long len = 0;
+        unsigned int end = pos;
+        while ((end < size) && (records[end] >= '0') && (records[end] <= '9') && (len <= size)){
+            len = len * 10 + (records[end++] - '0');
+        }
+        if (!len || (len > size - pos) || (end + 1 >= pos + len) || (records[end] != ' ') || (records[pos + len - 1] != '\n')){
+            break;
         }
 
-        printf( "%s", entry -> name);
+        const char * key = records + end + 1;
+        const char * eq = memchr(key, '=', records + pos + len - key);
+        if (eq){
+            const size_t keylen = eq - key;
+            const size_t vallen = records + pos + len - 1 - (eq + 1);
+            if ((keylen == strlen(DIGEST_KEYWORD)) && !strncmp(key, DIGEST_KEYWORD, keylen)){
+                entry -> digest = DIGEST_CRC32C;
+                entry -> crc32c = 0;
+                for(size_t i = 0; (i < vallen) && isxdigit((unsigned char) eq[1 + i]); i++){
+                    const char c = eq[1 + i];
+                    entry -> crc32c = (entry -> crc32c << 4) | ((c <= '9')?(c - '0'):((c | 0x20) - 'a' + 10));
+                }
+            }
+            else if ((keylen == 4) && !strncmp(key, "path", 4)){
+                entry -> long_name = long_copy(names -> name, eq + 1, vallen);
+            }
+            else if ((keylen == 8) && !strncmp(key, "linkpath", 8)){
+                entry -> long_link = long_copy(names -> link, eq + 1, vallen);
+            }
+        }
 
+        pos += len;
+    }
+}
 
-        printf("\n");
+// point long_name and long_link at names the header fields alone do not hold
+static void complete_names(struct tar_t * entry, struct tar_names * names){
+    if (!entry -> long_name){
+        const size_t len = strnlen(entry -> name, sizeof(entry -> name));
+        const size_t prefix = memcmp(entry -> ustar, "ustar", 6)?0:strnlen(entry -> prefix, sizeof(entry -> prefix));
+        if (prefix){
+            memcpy(names -> name, entry -> prefix, prefix);
+            names -> name[prefix] = '/';
+            memcpy(names -> name + prefix + 1, entry -> name, len);
+            names -> name[prefix + 1 + len] = '\0';
+            entry -> long_name = names -> name;
+        }
+        else if (len == sizeof(entry -> name)){
+            entry -> long_name = long_copy(names -> name, entry -> name, len);
+        }
     }
 
-    return 0;
+    if (!entry -> long_link && (strnlen(entry -> link_name, sizeof(entry -> link_name)) == sizeof(entry -> link_name))){
+        entry -> long_link = long_copy(names -> link, entry -> link_name, sizeof(entry -> link_name));
+    }
 }
 
+// consume extended headers until the header they describe is in entry -> block
+// returns number of bytes consumed
+static int read_extended(const int fd, struct tar_t * entry, struct tar_names * names){
+    int extended = 0;
+    while ((entry -> type == PAX_HEADER) || (entry -> type == PAX_GLOBAL) || (entry -> type == GNU_LONGNAME) || (entry -> type == GNU_LONGLINK)){
+        const unsigned int size = tar_get_size(entry);
+        const unsigned int padded = size + ((size % 512)?(512 - (size % 512)):0);
+
+        char * records = calloc(padded + 1, sizeof(char));
+        if (read_size(fd, records, padded) != padded){
+            free(records);
+            return -1;
+        }
 
-int tar_extract(const int fd, struct tar_t * archive, int filecount, const char * files[], const char verbosity){
-    int ret = 0;
+        // global records are not tracked
+        if (entry -> type == PAX_HEADER){
+            pax_parse(entry, records, size, names);
+        }
+        else if (entry -> type == GNU_LONGNAME){
+            entry -> long_name = long_copy(names -> name, records, strnlen(records, size));
+        }
+        else if (entry -> type == GNU_LONGLINK){
+            entry -> long_link = long_copy(names -> link, records, strnlen(records, size));
+        }
+        free(records);
 
-    // extract entries with given names
-    if (filecount){
-        if (!files){
-            ERROR("Received NULL file list");
+        if (read_size(fd, entry -> block, 512) != 512){
             return -1;
         }
+        extended += 512 + padded;
+    }
 
-        while (archive){
-            for(size_t i = 0; i < filecount; i++){
-                if (!strncmp(archive -> name, files[i], MAX(strlen(archive -> name), strlen(files[i])))){
-                    //Start from particular File
-                    if (lseek(fd, archive -> begin, SEEK_SET) == (off_t) (-1)){
-                        RC_ERROR("Unable to seek file: %s", strerror(rc));
-                    }
+    complete_names(entry, names);
+    return extended;
+}
 
-                    if (extract_entry(fd, archive, verbosity) < 0){
-                        ret = -1;
+// format a single PAX record into buf, returns its length
+static int pax_record(char * buf, const size_t space, const char * key, const char * value){
+    // the length prefix counts its own digits
+    const int base = strlen(key) + strlen(value) + 3;
+    int len = base + 1;
+    while (snprintf(NULL, 0, "%d", len) + base != len){
+        len++;
+    }
 
-                    }
-                    break;
-                }
-            }
-            archive = archive -> next;
-        }
+    if (len >= space){
+        return -1;
     }
 
-     // extract all
-    else{
-        // move offset to beginning
-        //Start from 0th location File
-        if (lseek(fd, 0, SEEK_SET) == (off_t) (-1)){
-            RC_ERROR("Unable to seek file: %s", strerror(rc));
-        }
+    return snprintf(buf, space, "%d %s=%s\n", len, key, value);
+}
 
-        // extract each entry
-        while (archive){
-            if (extract_entry(fd, archive, verbosity) < 0){
-                ret = -1;
-            }
-            archive = archive -> next;
-        }
-    }
+// fill in the header of a PAX extended header with size bytes of records for entry
+static void format_pax_header(struct tar_t * pax, const struct tar_t * entry, const unsigned int size){
+    memset(pax, 0, sizeof(struct tar_t));
+    snprintf(pax -> name, sizeof(pax -> name), "PaxHeader/%.89s", entry -> name);
+    tar_set_mode(pax, 0644);
+    memcpy(pax -> uid, entry -> uid, sizeof(pax -> uid));
+    memcpy(pax -> gid, entry -> gid, sizeof(pax -> gid));
+    tar_set_size(pax, size);
+    memcpy(pax -> mtime, entry -> mtime, sizeof(pax -> mtime));
+    pax -> type = PAX_HEADER;
+    memcpy(pax -> ustar, "ustar\00000", 8);
+    calculate_checksum(pax);
+}
 
-    return ret;
+// write a PAX extended header holding the given records for entry
+// returns number of bytes written
+static int write_pax_header(const int fd, struct tar_t * entry, const char * records, const unsigned int size){
+    struct tar_t pax;
+    format_pax_header(&pax, entry, size);
 
-}
+    const unsigned int padded = size + ((size % 512)?(512 - (size % 512)):0);
+    char * data = calloc(padded, sizeof(char));
+    memcpy(data, records, size);
 
-int extract_entry(const int fd, struct tar_t * entry, const char verbosity){
-    V_PRINT(stdout, "%s", entry -> name);
+    int rc = -1;
+    if ((archive_write(fd, pax.block, 512) == 512) && (archive_write(fd, data, padded) == padded)){
+        rc = 512 + padded;
+    }
+    free(data);
 
-    if ((entry -> type == REGULAR) || (entry -> type == NORMAL) || (entry -> type == CONTIGUOUS)){
-        // create intermediate directories
-        size_t len = strlen(entry -> name);
-        if (!len)
-        {
-            ERROR("Attempted to extract entry with empty name");
-        }
+    return rc;
+}
 
-        char * path = calloc(len + 1, sizeof(char));
-        strncpy(path, entry -> name, len);
+// write a GNU long name or long link header carrying value
+// returns number of bytes written
+static int write_gnu_long(const int fd, const char type, const char * value){
+    struct tar_t gnu;
+    memset(&gnu, 0, sizeof(struct tar_t));
+    const unsigned int size = strlen(value) + 1;
+    strcpy(gnu.name, "././@LongLink");
+    tar_set_mode(&gnu, 0644);
+    tar_set_uid(&gnu, 0);
+    tar_set_gid(&gnu, 0);
+    tar_set_size(&gnu, size);
+    tar_set_mtime(&gnu, 0);
+    gnu.type = type;
+    memcpy(gnu.ustar, "ustar  ", 8);
+    calculate_checksum(&gnu);
+
+    const unsigned int padded = size + ((size % 512)?(512 - (size % 512)):0);
+    char * data = calloc(padded, sizeof(char));
+    memcpy(data, value, size);
+
+    int rc = -1;
+    if ((archive_write(fd, gnu.block, 512) == 512) && (archive_write(fd, data, padded) == padded)){
+        rc = 512 + padded;
+    }
+    free(data);
 
-        // remove file from path
-        while (--len && (path[len] != '/'));
-        path[len] = '\0';   // if nothing was found, path is terminated
+    return rc;
+}
 
-        if (recursive_mkdir(path, DEFAULT_DIR_MODE, verbosity) < 0){
-            V_PRINT(stderr, "Could not make directory %s", path);
-            free(path);
+// write the extended headers an entry needs, followed by its own header
+// if digest is set, a digest record is reserved and *digest_at is set to the archive offset of its value
+// returns number of bytes written before the entry's own header
+static int write_header(const int fd, struct tar_t * entry, const int offset, const char digest, off_t * digest_at){
+    const char * name = (entry -> long_name && !entry -> prefix[0] && (strlen(entry -> long_name) > sizeof(entry -> name)))?entry -> long_name:NULL;
+    const char * link = (entry -> long_link && (strlen(entry -> long_link) > sizeof(entry -> link_name)))?entry -> long_link:NULL;
+    int extended = 0;
+    *digest_at = -1;
+
+    if (tar_opts.format == FORMAT_GNU){
+        int rc;
+        if (link && ((rc = write_gnu_long(fd, GNU_LONGLINK, link)) < 0)){
             return -1;
         }
-        free(path);
-
-        if ((entry -> type == REGULAR) || (entry -> type == NORMAL) || (entry -> type == CONTIGUOUS)){
-            // create file
-            const unsigned int size = oct2uint(entry -> size, 11);
-            int f = open(entry -> name, O_WRONLY | O_CREAT | O_TRUNC, oct2uint(entry -> mode, 7) & 0777);
-            if (f < 0){
-                RC_ERROR("Unable to open file %s: %s", entry -> name, strerror(rc));
-            }
-
-            // move archive pointer to data location
-            if (lseek(fd, 512 + entry -> begin, SEEK_SET) == (off_t) (-1)){
-                RC_ERROR("Bad index: %s", strerror(rc));
-            }
-
-            // copy data to file
-            char buf[512];
-            int got = 0;
-            while (got < size){
-                int r;
-                if ((r = read_size(fd, buf, MIN(size - got, 512))) < 0){
-                    RC_ERROR("Unable to read from archive: %s", strerror(rc));
-                }
-
-                if (write(f, buf, r) != r){
-                    RC_ERROR("Unable to write to %s: %s", entry -> name, strerror(rc));
-                }
-
-                got += r;
-            }
+        extended += link?rc:0;
 
-            close(f);
+        if (name && ((rc = write_gnu_long(fd, GNU_LONGNAME, name)) < 0)){
+            return -1;
         }
+        extended += name?rc:0;
 
+        name = link = NULL;
     }
 
-    return 0;
-}
-
+    if (name || link || digest){
+        // records only go to the heap when names are long
+        char small[512];
+        const size_t space = (name?strlen(name):0) + (link?strlen(link):0) + 64;
+        char * records = (space <= sizeof(small))?small:malloc(space);
 
-//States difference between archive and file system
-int tar_diff(FILE * f, struct tar_t * archive, const char verbosity){
-    struct stat st;
-    while (archive){
-        V_PRINT(stdout,"%s", archive -> name);
-
-        // if not found, print error
-        if (stat(archive -> name, &st)){
-            int rc = errno;
-            printf("Could not ");
-            if (archive -> type == SYMLINK){
-                printf("readlink");
-            }
-            else{
-                printf("stat");
-            }
-            printf(" %s: %s", archive -> name, strerror(rc));
+        int used = 0;
+        if (name){
+            used += pax_record(records + used, space - used, "path", name);
         }
-        else{
-
-            if (st.st_mtime != oct2uint(archive -> mtime, 11)){
-//                struct tm dt = *(gmtime(&st.st_mtime));
-                printf("%s: Modification time differs\n", archive -> name);
-//                printf("Modified on : %d-%d-%d %d:%d:%d\n", dt.tm_mday,dt.tm_mon,dt.tm_year+1900,dt.tm_hour,dt.tm_min,dt.tm_sec);
-            }
-            if (st.st_size != oct2uint(archive -> size, 11)){
-                printf("%s: size differs \n", archive -> name);
+        if (link){
+            used += pax_record(records + used, space - used, "linkpath", link);
+        }
+        if (digest){
+            // a digest that is already known (an entry being copied) is written as is
+            char hex[9] = "00000000";
+            if (entry -> digest == DIGEST_CRC32C){
+                snprintf(hex, sizeof(hex), "%08x", entry -> crc32c);
             }
-            if (st.st_mode != oct2uint(archive -> mode, 11)){
-                printf("%s: Mode differs", archive -> name);
+            used += pax_record(records + used, space - used, DIGEST_KEYWORD, hex);
+            if (entry -> digest != DIGEST_CRC32C){
+                *digest_at = offset + extended + 512 + used - 9;
             }
+        }
 
+        const int rc = write_pax_header(fd, entry, records, used);
+        if (records != small){
+            free(records);
         }
-        printf("\n");
-        printf("\n");
-        archive = archive -> next;
+        if (rc < 0){
+            return -1;
+        }
+        extended += rc;
     }
-    return 0;
-}
 
+    if (archive_write(fd, entry -> block, 512) != 512){
+        return -1;
+    }
 
-int recursive_mkdir(const char * dir, const unsigned int mode, const char verbosity){
-   // int rc = 0;
-    const size_t len = strlen(dir);
+    return extended;
+}
 
-    if (!len){
+// move fd to the next header, skipping data the caller did not consume
+static int iter_skip(struct tar_iter * iter){
+    if (stats_lseek(iter -> fd, iter -> offset, SEEK_SET) != (off_t) (-1)){
+        iter -> pos = iter -> offset;
         return 0;
     }
 
-    char * path = calloc(len + 1, sizeof(char));
-    strncpy(path, dir, len);
-
-    // remove last '/'
-    if (path[len - 1] ==  '/'){
-       path[len - 1] = 0;
+    if ((errno != ESPIPE) || (iter -> pos > iter -> offset)){
+        RC_ERROR("Unable to seek file: %s", strerror(rc));
     }
 
-
-
-    if (mkdir(path) < 0){
-        RC_ERROR("Could not create directory %s: %s", path, strerror(rc));
+    // pipes can only move forward
+    char buf[512];
+    while (iter -> pos < iter -> offset){
+        const int r = read_size(iter -> fd, buf, MIN(iter -> offset - iter -> pos, 512));
+        if (r <= 0){
+            ERROR("Unable to skip data");
+        }
+        iter -> pos += r;
     }
 
-    free(path);
     return 0;
 }
 
-int tar_remove(const int fd, struct tar_t ** archive, int filecount, const char * files[], const char verbosity){
+int tar_iter_init(struct tar_iter * iter, const int fd, const char verbosity){
     if (fd < 0){
-        return -1;
+        ERROR("Bad file descriptor");
     }
 
-    // archive has to exist
-    if (!archive || !*archive){
-        ERROR("Got bad archive");
+    if (!iter){
+        ERROR("Bad iterator");
     }
 
-    if (filecount && !files){
-        ERROR("Non-zero file count provided, but file list is NULL");
-    }
+    memset(iter, 0, sizeof(struct tar_iter));
+    iter -> fd = fd;
+    iter -> verbosity = verbosity;
+    return 0;
+}
 
-    if (!filecount){
-        V_PRINT(stderr, "No entries specified");
+int tar_iter_next(struct tar_iter * iter, struct tar_t * entry){
+    const char verbosity = iter -> verbosity;
+    if (iter -> done){
         return 0;
     }
 
-
-
-    // reset offset of original file
-    if (lseek(fd, 0, SEEK_SET) == (off_t) (-1)){
-        RC_ERROR("Unable to seek file: %s", strerror(rc));
+    if (iter_skip(iter) < 0){
+        return -1;
     }
 
-    // find first file to be removed that does not exist
-    int ret = 0;
-    for(int i = 0; i < filecount; i++){
-        if (!exists(*archive, files[i], 0)){
-            ERROR("'%s' not found in archive", files[i]);
-        }
+    memset(entry, 0, sizeof(struct tar_t));
+    unsigned int begin = iter -> offset;
+    if (read_size(iter -> fd, entry -> block, 512) != 512){
+        V_PRINT(stderr, "Error: Bad read. Stopping");
+        iter -> done = 1;
+        return 0;
     }
 
-    unsigned int read_offset = 0;
-    unsigned int write_offset = 0;
-    struct tar_t * prev = NULL;
-    struct tar_t * curr = *archive;
-    while(curr){
-        // get original size
-        int total = 512;
-
-        if ((curr -> type == REGULAR) || (curr -> type == NORMAL)){
-            total += oct2uint(curr -> size, 11);
-            if (total % 512){
-                total += 512 - (total % 512);
-            }
-        }
-
-        const int match = check_match(curr, filecount, files);
-
-        if (match < 0){
-            ERROR("Match failed");
+    // if current block is all zeros
+    if (iszeroed(entry -> block, 512)){
+        begin += 512;
+        if (read_size(iter -> fd, entry -> block, 512) != 512){
+            V_PRINT(stderr, "Error: Bad read. Stopping");
+            iter -> done = 1;
+            return 0;
         }
-   else if (!match){
-            // if the old data is not in the right place, move it
-            if (write_offset < read_offset){
-                int got = 0;
-                while (got < total){
-                    // go to old data
-                    if (lseek(fd, read_offset, SEEK_SET) == (off_t) (-1)){
-                        RC_ERROR("Cannot seek: %s", strerror(rc));
-                    }
-
-                    char buf[512];
 
-                    // copy chunk out
-                    if (read_size(fd, buf, 512) != 512){// guarenteed 512 octets
-                        ERROR("Read error");
-                    }
-
-                    // go to new position
-                    if (lseek(fd, write_offset, SEEK_SET) == (off_t) (-1)){
-                        RC_ERROR("Cannot seek: %s", strerror(rc));
-                    }
-
-                    // write data in
-                    if (write_size(fd, buf, 512) != 512){
-                        RC_ERROR("Write error: %s", strerror(rc));
-                    }
-
-                    // increment offsets
-                    got += 512;
-                    read_offset += 512;
-                    write_offset += 512;
-                }
-            }
-            else{
-                read_offset += total;
-                write_offset += total;
+        // check if next block is all zeros as well
+        if (iszeroed(entry -> block, 512)){
+            iter -> done = 1;
 
-                // skip past data
-                if (lseek(fd, read_offset, SEEK_SET) == (off_t) (-1)){
-                    RC_ERROR("Cannot seek: %s", strerror(rc));
-                }
+            // skip to end of record
+            iter -> pos = begin + 512;
+            iter -> offset = iter -> pos + ((iter -> pos % RECORDSIZE)?(RECORDSIZE - (iter -> pos % RECORDSIZE)):0);
+            if (iter_skip(iter) < 0){
+                V_PRINT(stderr, "Error: Archive is not padded to a full record");
             }
-            prev = curr;
-            curr = curr -> next;
+            return 0;
         }
+    }
 
-        else{// if name matches, skip the data
-            struct tar_t * tmp = curr;
-            if (!prev){
-                *archive = curr -> next;
-                if (*archive){
-                    (*archive) -> begin = 0;
-                }
-            }
-            else{
-                prev -> next = curr -> next;
+    // extended headers describe the entry that follows them
+    const int extended = read_extended(iter -> fd, entry, &iter -> names);
+    if (extended < 0){
+        V_PRINT(stderr, "Error: Bad read. Stopping");
+        iter -> done = 1;
+        return 0;
+    }
 
-                if (prev -> next){
-                    prev -> next -> begin = curr -> begin;
-                }
-            }
-            curr = curr -> next;
-            free(tmp);
+    // set current entry's file offset
+    entry -> begin = begin + extended;
+    entry -> extended = extended;
 
-            // next read starts after current entry
-            read_offset += total;
-        }
+    // members this large cannot be tracked (see format_tar_data)
+    if (tar_get_size(entry) > UINT_MAX - 511){
+        fprintf(stderr, "Error: %s is too large\n", tar_entry_name(entry));
+        iter -> done = 1;
+        return -1;
     }
 
-    // resize file
-    if (ftruncate(fd, write_offset) < 0){
-        RC_ERROR("Could not truncate file: %s", strerror(rc));
+    // next header is after data and unfilled block
+    unsigned int jump = tar_get_size(entry);
+    if (jump % 512){
+        jump += 512 - (jump % 512);
     }
 
-
-    return ret;
+    iter -> pos = entry -> begin + 512;
+    iter -> offset = iter -> pos + jump;
+    return 1;
 }
 
-// check if entry is a match for any of the given file names
-// returns index + 1 if match is found
-int check_match(struct tar_t * entry, int filecount, const char * files[]){
-    if (!entry){
+// read a tar file
+// archive should be address to null pointer
+int tar_read(const int fd, struct tar_t ** archive, const char verbosity){
+    STATS_PHASE(PHASE_READ);
+
+    if (fd < 0){                //fd is always > 0
+        ERROR("Bad file descriptor");
+    }
+    //if archive is NOT NULL
+    if (!archive || *archive){
+        ERROR("Bad archive");
+    }
+
+    struct tar_iter iter;
+    if (tar_iter_init(&iter, fd, verbosity) < 0){
         return -1;
     }
 
-    if (!filecount){
-        return 0;
+    int count = 0;
+    struct tar_t ** tar = archive;
+    struct tar_t entry;
+    int rc;
+    while ((rc = tar_iter_next(&iter, &entry)) > 0){
+        // long names are kept in the same allocation as their entry
+        const size_t name = entry.long_name?(strlen(entry.long_name) + 1):0;
+        const size_t link = entry.long_link?(strlen(entry.long_link) + 1):0;
+        *tar = malloc(sizeof(struct tar_t) + name + link);
+        **tar = entry;
+
+        char * names = (char *) (*tar + 1);
+        if (name){
+            (*tar) -> long_name = memcpy(names, entry.long_name, name);
+        }
+        if (link){
+            (*tar) -> long_link = memcpy(names + name, entry.long_link, link);
+        }
+
+        // ready next value
+        tar = &((*tar) -> next);
+        count++;
     }
+    *tar = NULL;
 
-    if (filecount && !files){
+    if (rc < 0){
         return -1;
     }
 
+    return count;
+}
+
+// compile a file list and the excluded patterns into one matcher
+static int tar_matcher(struct matcher * m, int filecount, const char * files[]){
+    matcher_init(m);
     for(int i = 0; i < filecount; i++){
-        if (!strncmp(entry -> name, files[i], MAX(strlen(entry -> name), strlen(files[i])) + 1)){
-            return i + 1;
+        if (matcher_add(m, files[i], MATCH_INCLUDE) < 0){
+            matcher_free(m);
+            return -1;
+        }
+    }
+    for(int i = 0; i < tar_opts.exclude_count; i++){
+        if (matcher_add(m, tar_opts.exclude[i], MATCH_EXCLUDE) < 0){
+            matcher_free(m);
+            return -1;
         }
     }
-
     return 0;
 }
 
-//writing
-int tar_write(const int fd, struct tar_t ** archive,int filecount, const char * files[], const char verbosity){
-    if (fd < 0){
-        ERROR("Bad file descriptor");
-    }
+// visit entries in archive order without reading the whole index first
+// with a file list, only entries selected by it are visited; with first set and a list naming
+// only files, the walk stops once all of them were seen, otherwise it reads the whole archive
+static int walk(const int fd, int filecount, const char * files[], int (*visit)(const int fd, struct tar_t * entry, void * arg), void * arg, const char first, const char verbosity){
+    STATS_PHASE(PHASE_READ);
 
-    if (!archive){
-        ERROR("Bad archive");
+    if (filecount && !files){
+        ERROR("Non-zero file count provided, but file list is NULL");
     }
 
-    // where file descriptor offset is
-    int offset = 0;
-
-    // if there is old data
-    struct tar_t ** tar = archive;
-
+    struct tar_iter iter;
+    if (tar_iter_init(&iter, fd, verbosity) < 0){
+        return -1;
+    }
 
-    if (*tar){
-        // skip to last entry
-        while (*tar && (*tar) -> next){
-            tar = &((*tar) -> next);
+    struct matcher m;
+    if (tar_matcher(&m, filecount, files) < 0){
+        ERROR("Unable to compile file list");
+    }
+    const char select = filecount || m.excludes;
+
+    char * seen = calloc(filecount + 1, sizeof(char));      // patterns that selected some entry
+    char * found = calloc(filecount + 1, sizeof(char));     // literal patterns that named a non-directory
+    int remaining = first?filecount:-1;
+    int ret = 0, rc;
+
+    struct tar_t entry;
+    while ((rc = tar_iter_next(&iter, &entry)) > 0){
+        if (select){
+            const char * name = tar_entry_name(&entry);
+            if (matcher_match(&m, name, seen) < 0){
+                continue;
+            }
 
+            // nothing else can match the name of a file
+            for(int i = 0; first && m.literal && (entry.type != DIRECTORY) && (i < filecount); i++){
+                if (!found[i] && !strcmp(m.patterns[i], name)){
+                    found[i] = 1;
+                    remaining--;
+                }
+            }
         }
 
-        // get offset past final entry
-        unsigned int jump = 512 + oct2uint((*tar) -> size, 11);
-        if (jump % 512){
-            jump += 512 - (jump % 512);
+        const int r = visit(fd, &entry, arg);
+        if (r < 0){
+            ret = -1;
+        }
+        else{
+            iter.pos += r;                  // data the visitor read from a pipe
         }
 
-        // move file descriptor
-        offset = (*tar) -> begin + jump;
-
-        if (lseek(fd, offset, SEEK_SET) == (off_t) (-1)){
-            RC_ERROR("Unable to seek file: %s", strerror(rc));
+        if (filecount && m.literal && !remaining){
+            break;
         }
-        tar = &((*tar) -> next);
     }
 
-
-    // write entries first
-    if (write_entries(fd, tar, archive, filecount, files, &offset, verbosity) < 0){
-        ERROR("Failed to write entries");
+    // report names that were never found
+    for(int i = 0; (rc >= 0) && (i < filecount); i++){
+        if (!seen[i]){
+            fprintf(stderr, "Error: '%s' not found in archive\n", files[i]);
+            ret = -1;
+        }
     }
+    free(found);
+    free(seen);
+    matcher_free(&m);
 
-    // write ending data
-    if (write_end_data(fd, offset, verbosity) < 0){
-        ERROR("Failed to write end data");
+    if (rc < 0){
+        return -1;
     }
 
-    // clear original names from data
-    tar = archive;
-    while (*tar){
-        memset((*tar) -> name, 0, 100);
-        tar = &((*tar) -> next);
-    }
+    return ret;
+}
 
-    return offset;
+// appended archives can hold newer copies of a name further on, so these read the whole archive
+int tar_walk(const int fd, int filecount, const char * files[], int (*visit)(const int fd, struct tar_t * entry, void * arg), void * arg, const char verbosity){
+    return walk(fd, filecount, files, visit, arg, 0, verbosity);
+}
 
+int tar_walk_first(const int fd, int filecount, const char * files[], int (*visit)(const int fd, struct tar_t * entry, void * arg), void * arg, const char verbosity){
+    return walk(fd, filecount, files, visit, arg, 1, verbosity);
 }
 
+// files up to this size are extracted and archived through io_uring batches
+#define URING_FILE_MAX (1024 * 1024)
+
+// most archive data read by one batch, from the first batched member to the end of the last
+#define URING_BATCH_BYTES (16 * 1024 * 1024)
+
+// small regular entries waiting to be written out together
+struct extract_batch {
+    struct tar_t entries[URING_BATCH];
+    int count;
+    struct tar_extract_ctx * ctx;           // directories shared by the whole extraction
+};
+
+static int batch_extract(const int fd, struct tar_t * entry, struct extract_batch * batch, const char verbosity);
+static int batch_flush(const int fd, struct extract_batch * batch, const char verbosity);
+
+struct extract_state {
+    struct tar_extract_ctx ctx;
+    struct extract_batch * batch;           // NULL when entries cannot be batched
+    off_t resume_at;                        // members before this were extracted by an interrupted run
+    char seekable;
+    char verbosity;
+};
+
+// offset right after an entry and its data
+static off_t entry_end(struct tar_t * entry){
+    const unsigned int size = tar_get_size(entry);
+    return (off_t) entry -> begin + 512 + size + ((size % 512)?(512 - (size % 512)):0);
+}
 
-int write_entries(const int fd, struct tar_t ** archive, struct tar_t ** head, const size_t filecount, const char * files[], int * offset, const char verbosity){
+static int extract_visit(const int fd, struct tar_t * entry, void * arg){
+    struct extract_state * state = arg;
+
+    // directories are created again so their metadata is still restored at the end
+    if (((off_t) entry -> begin < state -> resume_at) && (entry -> type != DIRECTORY)){
+        return 0;
+    }
+
+    if (!state -> batch){
+        if (extract_entry_ctx(&state -> ctx, fd, entry, state -> verbosity) < 0){
+            return -1;
+        }
+        checkpoint_save(-1, entry_end(entry), tar_entry_name(entry));
+
+        // on pipes the data was read in place
+        const char regular = (entry -> type == REGULAR) || (entry -> type == NORMAL) || (entry -> type == CONTIGUOUS);
+        return (state -> seekable || !regular)?0:tar_get_size(entry);
+    }
+
+    // batched members are only complete once nothing is queued
+    const int rc = batch_extract(fd, entry, state -> batch, state -> verbosity);
+    if ((rc >= 0) && !state -> batch -> count){
+        checkpoint_save(-1, entry_end(entry), tar_entry_name(entry));
+    }
+    return rc;
+}
+
+// copy size bytes of the archive to out, from offset or, if offset < 0, from where fd is
+// the data stays in the kernel where possible (copy_file_range or sendfile from files, splice from pipes)
+static int stream_data(const int out, const int fd, off_t offset, const unsigned int size){
+    static __thread char buf[65536];
+    char kernel = (offset < 0)?1:2;         // 2: copy_file_range, 1: sendfile or splice, 0: read and write
+    unsigned int done = 0;
+    while (done < size){
+        const unsigned int want = MIN(size - done, 1 << 20);
+        ssize_t r = -1;
+#ifdef __linux__
+        if (kernel){
+            throttle(want);
+            if (kernel == 2){
+                r = copy_file_range(fd, &offset, out, NULL, want, 0);
+            }
+            else{
+                r = (offset < 0)?splice(fd, NULL, out, NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE):sendfile(out, fd, &offset, want);
+            }
+
+            // not supported for this pair of descriptors; try the next way down
+            if ((r < 0) && ((errno == EINVAL) || (errno == ENOSYS) || (errno == EXDEV) || (errno == EBADF) || (errno == EOPNOTSUPP))){
+                kernel--;
+                continue;
+            }
+
+            if (r > 0){
+                stats_add(STAT_READS, 1);
+                stats_add(STAT_WRITES, 1);
+                stats_add(STAT_BYTES_READ, r);
+                stats_add(STAT_BYTES_WRITTEN, r);
+            }
+        }
+        else
+#endif
+        {
+            const int chunk = MIN(want, sizeof(buf));
+            r = (offset < 0)?read_size(fd, buf, chunk):pread_size(fd, buf, chunk, offset);
+            if (r > 0){
+                if (write_size(out, buf, r) != r){
+                    return -1;
+                }
+                offset += (offset < 0)?0:r;
+            }
+        }
+
+        if (r <= 0){
+            if (!r){
+                errno = EIO;                // archive ended inside the member
+            }
+            return -1;
+        }
+        done += r;
+    }
+
+    return 0;
+}
+
+// member found while streaming from a seekable archive
+struct stream_member {
+    char * name;
+    off_t begin;
+    unsigned int size;
+};
+
+struct stream_state {
+    int out;
+    char seekable;
+    char first;                             // write the first copy of a name as soon as it is found
+    struct stream_member * members;         // matches, streamed once the newest copy of each is known
+    int count;
+    int space;
+};
+
+static int stream_visit(const int fd, struct tar_t * entry, void * arg){
+    struct stream_state * state = arg;
+    if ((entry -> type != REGULAR) && (entry -> type != NORMAL) && (entry -> type != CONTIGUOUS)){
+        return 0;
+    }
+
+    const unsigned int size = tar_get_size(entry);
+    if (state -> seekable && !state -> first){
+        if (state -> count == state -> space){
+            state -> space = state -> space?(2 * state -> space):64;
+            state -> members = realloc(state -> members, state -> space * sizeof(struct stream_member));
+        }
+        struct stream_member * member = &state -> members[state -> count++];
+        member -> name = strdup(tar_entry_name(entry));
+        member -> begin = entry -> begin;
+        member -> size = size;
+        return 0;
+    }
+
+    // a pipe cannot go back, so every copy of a name is written as it comes
+    if (stream_data(state -> out, fd, state -> seekable?(off_t) entry -> begin + 512:-1, size) < 0){
+        RC_ERROR("Unable to stream %s: %s", tar_entry_name(entry), strerror(rc));
+    }
+    stats_add(STAT_ENTRIES, 1);
+
+    return state -> seekable?0:size;
+}
+
+// by name, then archive order
+static int compare_stream_name(const void * a, const void * b){
+    const struct stream_member * x = a, * y = b;
+    const int c = strcmp(x -> name, y -> name);
+    return c?c:((x -> begin > y -> begin) - (x -> begin < y -> begin));
+}
+
+static int compare_stream_begin(const void * a, const void * b){
+    const struct stream_member * x = a, * y = b;
+    return (x -> begin > y -> begin) - (x -> begin < y -> begin);
+}
+
+static int ls_visit(const int fd, struct tar_t * entry, void * arg){
+    return ls_entry(stdout, entry, 0, NULL, *(const char *) arg);
+}
+
+static int metadata_visit(const int fd, struct tar_t * entry, void * arg){
+    return print_entry_metadata(stdout, entry);
+}
+
+int tar_extract_lazy(const int fd, int filecount, const char * files[], const char verbosity){
+    STATS_PHASE(PHASE_EXTRACT);
+
+    // batched data is read later with pread, which pipes cannot do
+    struct extract_state state = { .batch = NULL, .verbosity = verbosity };
+    if (extract_ctx_init(&state.ctx) < 0){
+        ERROR("Unable to allocate directory cache");
+    }
+    state.seekable = stats_lseek(fd, 0, SEEK_CUR) != (off_t) (-1);
+    if (tar_opts.uring && state.seekable){
+        state.batch = calloc(1, sizeof(struct extract_batch));
+        state.batch -> ctx = &state.ctx;
+    }
+
+    if (tar_opts.checkpoint){
+        state.resume_at = tar_opts.resume?checkpoint_load(tar_opts.checkpoint):0;
+        checkpoint_begin(tar_opts.checkpoint, state.resume_at);
+    }
+
+    int ret = tar_walk(fd, filecount, files, extract_visit, &state, verbosity);
+    if (state.batch){
+        if (batch_flush(fd, state.batch, verbosity) < 0){
+            ret = -1;
+        }
+        free(state.batch);
+    }
+    extract_ctx_finish(&state.ctx);
+    extract_ctx_free(&state.ctx);
+
+    if (!ret){
+        checkpoint_end();
+    }
+    checkpoint_path = NULL;
+
+    return ret;
+}
+
+int tar_stream(const int fd, int filecount, const char * files[], const int out, const char verbosity){
+    STATS_PHASE(PHASE_EXTRACT);
+
+    struct stream_state state = { .out = out, .first = tar_opts.occurrence };
+    state.seekable = stats_lseek(fd, 0, SEEK_CUR) != (off_t) (-1);
+    if (state.first){
+        return tar_walk_first(fd, filecount, files, stream_visit, &state, verbosity);
+    }
+
+    int ret = tar_walk(fd, filecount, files, stream_visit, &state, verbosity);
+
+    // only the newest copy of a name is written, in archive order
+    qsort(state.members, state.count, sizeof(struct stream_member), compare_stream_name);
+    int kept = 0;
+    for(int i = 0; i < state.count; i++){
+        if ((i + 1 < state.count) && !strcmp(state.members[i].name, state.members[i + 1].name)){
+            free(state.members[i].name);
+            continue;
+        }
+        state.members[kept++] = state.members[i];
+    }
+    qsort(state.members, kept, sizeof(struct stream_member), compare_stream_begin);
+
+    for(int i = 0; i < kept; i++){
+        if ((ret >= 0) && (stream_data(out, fd, state.members[i].begin + 512, state.members[i].size) < 0)){
+            fprintf(stderr, "Error: Unable to stream %s: %s\n", state.members[i].name, strerror(errno));
+            ret = -1;
+        }
+        stats_add(STAT_ENTRIES, 1);
+        free(state.members[i].name);
+    }
+    free(state.members);
+
+    return ret;
+}
+
+int tar_ls_lazy(const int fd, int filecount, const char * files[], const char verbosity){
+    return tar_walk_first(fd, filecount, files, ls_visit, (void *) &verbosity, verbosity);
+}
+
+int print_tar_metadata_lazy(const int fd, int filecount, const char * files[], const char verbosity){
+    return tar_walk_first(fd, filecount, files, metadata_visit, NULL, verbosity);
+}
+
+struct tar_t * exists(struct tar_t * archive, const char * filename, const char ori){
+    while (archive){
+        if (ori){
+            if (archive -> original_name && !strcmp(archive -> original_name, filename)){
+                return archive;
+            }
+        }
+        else{
+            if (!strcmp(tar_entry_name(archive), filename)){
+                return archive;
+            }
+        }
+        archive = archive -> next;
+    }
+    return NULL;
+}
+
+int print_tar_metadata(FILE * f, struct tar_t * archive){
+    while (archive){
+        print_entry_metadata(f, archive);
+        archive = archive -> next;
+    }
+
+    return 0;
+}
+
+int print_entry_metadata(FILE * f, struct tar_t * entry){
+    if (!entry){
+        return -1;
+    }
+
+    time_t mtime = tar_get_mtime(entry);
+    char mtime_str[32];
+    strftime(mtime_str, sizeof(mtime_str), "%c", localtime(&mtime));
+    printf( "File Name: %s\n", tar_entry_name(entry));
+    printf( "Owner UID: %s (%llu)\n", entry -> uid, tar_get_uid(entry));
+    printf( "Owner GID: %s (%llu)\n", entry -> gid, tar_get_gid(entry));
+    printf( "File Mode: %s (%03llo)\n", entry -> mode, tar_get_mode(entry));
+    printf( "File Size: %s (%llu)\n", entry -> size, tar_get_size(entry));
+    printf( "Time     : %s (%s)\n", entry -> mtime, mtime_str);
+    printf( "Checksum : %s\n", entry -> check);
+    printf( "File Type: ");
+    switch (entry -> type){
+        case REGULAR: case NORMAL:
+            printf( "Normal File");
+            break;
+        case HARDLINK:
+            printf( "Hard Link");
+            break;
+        case SYMLINK:
+            printf( "Symbolic Link");
+            break;
+        case CHAR:
+            printf( "Character Special");
+            break;
+        case BLOCK:
+            printf( "Block Special");
+            break;
+        case DIRECTORY:
+            printf( "Directory");
+            break;
+        case FIFO:
+            printf("FIFO");
+            break;
+        case CONTIGUOUS:
+            printf( "Contiguous File");
+            break;
+    }
+
+    printf("\n\n");
+    return 0;
+}
+
+// ls command
+int tar_ls(FILE * f, struct tar_t * archive, int filecount, const char * files[], const char verbosity){
+    if (!verbosity){
+        return 0;
+    }
+
+    if (filecount && !files){
+        ERROR("Non-zero file count provided, but file list is NULL");
+    }
+
+
+    struct matcher m;
+    if (tar_matcher(&m, filecount, files) < 0){
+        ERROR("Unable to compile file list");
+    }
+
+    int ret = 0;
+    while (archive){
+        if ((matcher_match(&m, tar_entry_name(archive), NULL) > 0) && (ls_entry(f, archive, 0, NULL, verbosity) < 0)){
+            ret = -1;
+            break;
+        }
+        archive = archive -> next;
+    }
+    matcher_free(&m);
+
+    return ret;
+}
+
+
+int ls_entry(FILE * f, struct tar_t * entry, int filecount, const char * files[], const char verbosity){
+    if (!verbosity){
+        return 0;
+    }
+
+    if (filecount && !files){
+        V_PRINT(stderr, "Error: Non-zero file count given but no files given");
+        return -1;
+    }
+
+    // figure out whether or not to print
+    // if no files were specified, print everything
+    // otherwise, search for matching names
+    const char print = !filecount || (check_match(entry, filecount, files) > 0);
+
+    if (print){
+        if (verbosity > 1){
+
+            const mode_t mode = tar_get_mode(entry);
+            const char mode_str[26] = { "-hlcbdp-"[entry -> type?entry -> type - '0':0],
+                                        mode & S_IRUSR?'r':'-',
+                                        mode & S_IWUSR?'w':'-',
+                                        mode & S_IXUSR?'x':'-',
+//                                        mode & S_IRGRP?'r':'-',
+//                                        mode & S_IWGRP?'w':'-',
+//                                        mode & S_IXGRP?'x':'-',
+//                                        mode & S_IROTH?'r':'-',
+//                                        mode & S_IWOTH?'w':'-',
+//                                        mode & S_IXOTH?'x':'-',
+                                        0};
+            // names from the header, numbers for entries written without them
+            if (entry -> owner[0]){
+                printf("%s %.32s/", mode_str, entry -> owner);
+            }
+            else{
+                printf("%s %llu/", mode_str, tar_get_uid(entry));
+            }
+            if (entry -> group[0]){
+                printf("%.32s ", entry -> group);
+            }
+            else{
+                printf("%llu ", tar_get_gid(entry));
+            }
+            char size_buf[22] = {0};
+            int rc = -1;
+            switch (entry -> type){
+                case REGULAR: case NORMAL: case CONTIGUOUS:
+                    rc = sprintf(size_buf, "%llu", tar_get_size(entry));
+                    break;
+                case HARDLINK: case SYMLINK: case DIRECTORY: case FIFO:
+                    rc = sprintf(size_buf, "%llu", tar_get_size(entry));
+                    break;
+
+            }
+
+            if (rc < 0){
+                ERROR("Failed to write length");
+            }
+
+            printf("%s", size_buf);
+
+            time_t mtime = tar_get_mtime(entry);
+            struct tm * time = localtime(&mtime);
+            printf(" %d-%02d-%02d %02d:%02d ", time -> tm_year + 1900, time -> tm_mon + 1, time -> tm_mday, time -> tm_hour, time -> tm_min);
+        }
+
+        printf( "%s", tar_entry_name(entry));
+
+
+        printf("\n");
+    }
+
+    return 0;
+}
+
+
+// archive data is read in ranges separated by less than this many bytes as one
+#define READ_GAP (256 * 1024)
+
+// chunk size used when copying data within the archive
+#define COPY_CHUNK (1024 * 1024)
+
+static int compare_begin(const void * a, const void * b){
+    const struct tar_t * x = *(struct tar_t * const *) a;
+    const struct tar_t * y = *(struct tar_t * const *) b;
+    return (x -> begin > y -> begin) - (x -> begin < y -> begin);
+}
+
+// sort entries by their location and announce the merged ranges that are about to be read
+static void schedule_reads(const int fd, struct tar_t ** entries, const int count){
+    qsort(entries, count, sizeof(struct tar_t *), compare_begin);
+
+#ifdef POSIX_FADV_WILLNEED
+    off_t start = 0, end = 0;
+    for(int i = 0; i < count; i++){
+        unsigned int size = tar_get_size(entries[i]);
+        if (size % 512){
+            size += 512 - (size % 512);
+        }
+
+        const off_t first = entries[i] -> begin - entries[i] -> extended;
+        const off_t last = (off_t) entries[i] -> begin + 512 + size;
+        if (end && (first - end < READ_GAP)){
+            end = MAX(end, last);
+            continue;
+        }
+
+        if (end){
+            posix_fadvise(fd, start, end - start, POSIX_FADV_WILLNEED);
+        }
+        start = first;
+        end = last;
+    }
+
+    if (end){
+        posix_fadvise(fd, start, end - start, POSIX_FADV_WILLNEED);
+    }
+#endif
+}
+
+// move len bytes of the archive from one offset to a lower one
+static int move_range(const int fd, const off_t from, const off_t to, const off_t len){
+    if ((from == to) || !len){
+        return 0;
+    }
+
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, from, len, POSIX_FADV_WILLNEED);
+#endif
+
+    // copying forward is safe since data only moves towards the start
+    char * buf = malloc(COPY_CHUNK);
+    off_t done = 0;
+    while (done < len){
+        const int want = MIN(len - done, COPY_CHUNK);
+        stats_add(STAT_WRITES, 1);
+        stats_add(STAT_BYTES_WRITTEN, want);
+        if ((pread_size(fd, buf, want, from + done) != want) || (pwrite(fd, buf, want, to + done) != want)){
+            free(buf);
+            return -1;
+        }
+        done += want;
+    }
+    free(buf);
+
+    return 0;
+}
+
+// copy len bytes from one file to another
+// the data stays in the kernel (or is reflinked) where the file systems allow it
+static int copy_range(const int in, off_t from, const int out, off_t to, const off_t len){
+    off_t done = 0;
+#ifdef __linux__
+    while (done < len){
+        const size_t want = MIN(len - done, 1 << 30);
+        throttle(want);
+        const ssize_t r = copy_file_range(in, &from, out, &to, want, 0);
+        if (r <= 0){
+            break;
+        }
+        stats_add(STAT_READS, 1);
+        stats_add(STAT_WRITES, 1);
+        stats_add(STAT_BYTES_READ, r);
+        stats_add(STAT_BYTES_WRITTEN, r);
+        done += r;
+    }
+#endif
+
+    // whatever is left goes through user space
+    char * buf = (done < len)?malloc(COPY_CHUNK):NULL;
+    while (done < len){
+        const int want = MIN(len - done, COPY_CHUNK);
+        stats_add(STAT_WRITES, 1);
+        stats_add(STAT_BYTES_WRITTEN, want);
+        if ((pread_size(in, buf, want, from) != want) || (pwrite(out, buf, want, to) != want)){
+            free(buf);
+            return -1;
+        }
+        from += want;
+        to += want;
+        done += want;
+    }
+    free(buf);
+
+    return 0;
+}
+
+int tar_extract(const int fd, struct tar_t * archive, int filecount, const char * files[], const char verbosity){
+    STATS_PHASE(PHASE_EXTRACT);
+
+    // extract entries with given names
+    if (filecount && !files){
+        ERROR("Received NULL file list");
+    }
+
+    struct tar_extract_ctx ctx;
+    if (extract_ctx_init(&ctx) < 0){
+        ERROR("Unable to allocate directory cache");
+    }
+
+    struct matcher m;
+    if (tar_matcher(&m, filecount, files) < 0){
+        extract_ctx_free(&ctx);
+        ERROR("Unable to compile file list");
+    }
+
+    int ret = 0;
+    struct extract_batch * batch = calloc(1, sizeof(struct extract_batch));
+    batch -> ctx = &ctx;
+
+    if (filecount || m.excludes){
+
+        // collect matches first so they can be read in archive order
+        // (every name is matched once, against all patterns at the same time)
+        int count = 0;
+        for(struct tar_t * entry = archive; entry; entry = entry -> next){
+            count++;
+        }
+
+        struct tar_t ** selected = calloc(count + 1, sizeof(struct tar_t *));
+        char * seen = calloc(filecount + 1, sizeof(char));
+        count = 0;
+        for(struct tar_t * entry = archive; entry; entry = entry -> next){
+            if (matcher_match(&m, tar_entry_name(entry), seen) > 0){
+                selected[count++] = entry;
+            }
+        }
+
+        for(int i = 0; i < filecount; i++){
+            if (!seen[i]){
+                fprintf(stderr, "Error: '%s' not found in archive\n", files[i]);
+                ret = -1;
+            }
+        }
+        free(seen);
+
+        schedule_reads(fd, selected, count);
+
+        for(int i = 0; i < count; i++){
+            if (batch_extract(fd, selected[i], batch, verbosity) < 0){
+                ret = -1;
+            }
+        }
+        free(selected);
+    }
+
+     // extract all
+    else{
+        // move offset to beginning
+        //Start from 0th location File
+        if (stats_lseek(fd, 0, SEEK_SET) == (off_t) (-1)){
+            const int rc = errno;
+            free(batch);
+            extract_ctx_free(&ctx);
+            matcher_free(&m);
+            ERROR("Unable to seek file: %s", strerror(rc));
+        }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+        // extract each entry
+        while (archive){
+            if (batch_extract(fd, archive, batch, verbosity) < 0){
+                ret = -1;
+            }
+            archive = archive -> next;
+        }
+    }
+
+    if (batch_flush(fd, batch, verbosity) < 0){
+        ret = -1;
+    }
+    free(batch);
+    extract_ctx_finish(&ctx);
+    extract_ctx_free(&ctx);
+    matcher_free(&m);
+
+    return ret;
+
+}
+
+uid_t tar_entry_uid(const struct tar_t * entry){
+    char owner[sizeof(entry -> owner) + 1] = {0};
+    memcpy(owner, entry -> owner, sizeof(entry -> owner));
+
+    uid_t uid;
+    if (idcache_uid(owner, &uid) < 0){
+        uid = tar_get_uid(entry);
+    }
+    return uid;
+}
+
+gid_t tar_entry_gid(const struct tar_t * entry){
+    char group[sizeof(entry -> group) + 1] = {0};
+    memcpy(group, entry -> group, sizeof(entry -> group));
+
+    gid_t gid;
+    if (idcache_gid(group, &gid) < 0){
+        gid = tar_get_gid(entry);
+    }
+    return gid;
+}
+
+static void restore_warn(const char * what, const char * name){
+    const int rc = errno;
+    fprintf(stderr, "Warning: Unable to restore %s of %s: %s\n", what, name, strerror(rc));
+}
+
+// apply owner, permissions (unless mode is -1) and modification time through an open descriptor
+// only root can give files away, so others keep their own ownership
+// failures are reported but do not fail the extraction
+static int restore_metadata(const int f, const char * name, const uid_t uid, const gid_t gid, const mode_t mode, const time_t mtime){
+    // chown clears set-id bits, so it goes first
+    if (!geteuid() && (fchown(f, uid, gid) < 0)){
+        restore_warn("owner", name);
+    }
+
+    if ((mode != (mode_t) -1) && (fchmod(f, mode) < 0)){
+        restore_warn("permissions", name);
+    }
+
+    const struct timespec times[2] = { { 0, UTIME_OMIT }, { mtime, 0 } };
+    if (futimens(f, times) < 0){
+        restore_warn("modification time", name);
+    }
+
+    return 0;
+}
+
+// restore a regular file while it is still open after its data was written
+// the creation mode already holds the permissions allowed by the umask; root gets the exact bits
+static int restore_entry(const int f, const struct tar_t * entry){
+    const mode_t mode = geteuid()?(mode_t) -1:(tar_get_mode(entry) & 07777);
+    return restore_metadata(f, tar_entry_name(entry), tar_entry_uid(entry), tar_entry_gid(entry), mode, tar_get_mtime(entry));
+}
+
+// most directory descriptors an extraction context keeps open
+#define DIR_FDS_MAX 256
+
+// umask of the process, read once
+static mode_t process_umask;
+static pthread_once_t process_umask_once = PTHREAD_ONCE_INIT;
+
+static void process_umask_init(void){
+    // umask() can only be read by changing it, which races with files being created on other threads
+    char line[128];
+    FILE * f = fopen("/proc/self/status", "r");
+    while (f && fgets(line, sizeof(line), f)){
+        unsigned int mask;
+        if (sscanf(line, "Umask: %o", &mask) == 1){
+            process_umask = mask;
+            fclose(f);
+            return;
+        }
+    }
+    if (f){
+        fclose(f);
+    }
+
+    process_umask = umask(0);
+    umask(process_umask);
+}
+
+int extract_ctx_init(struct tar_extract_ctx * ctx){
+    ctx -> buckets = 64;
+    ctx -> count = 0;
+    ctx -> open = 0;
+
+    // directory permissions are masked like newly created files, except for root
+    pthread_once(&process_umask_once, process_umask_init);
+    ctx -> umask = geteuid()?process_umask:0;
+
+    ctx -> dirs = calloc(ctx -> buckets, sizeof(struct tar_dir));
+    return ctx -> dirs?0:-1;
+}
+
+void extract_ctx_free(struct tar_extract_ctx * ctx){
+    for(unsigned int i = 0; i < ctx -> buckets; i++){
+        if (ctx -> dirs[i].path && (ctx -> dirs[i].fd >= 0)){
+            close(ctx -> dirs[i].fd);
+        }
+        free(ctx -> dirs[i].path);
+    }
+    free(ctx -> dirs);
+    ctx -> dirs = NULL;
+}
+
+// close descriptors once too many are open; the directories stay known to exist
+// only called between entries, so no descriptor handed out is still in use
+static void extract_ctx_trim(struct tar_extract_ctx * ctx){
+    if (ctx -> open <= DIR_FDS_MAX){
+        return;
+    }
+
+    for(unsigned int i = 0; i < ctx -> buckets; i++){
+        if (ctx -> dirs[i].path && (ctx -> dirs[i].fd >= 0)){
+            close(ctx -> dirs[i].fd);
+            ctx -> dirs[i].fd = -1;
+        }
+    }
+    ctx -> open = 0;
+}
+
+// slot holding path, or the empty slot where it belongs
+static struct tar_dir * extract_ctx_slot(struct tar_extract_ctx * ctx, const char * path, const size_t len){
+    unsigned int i = name_hash(path, len) & (ctx -> buckets - 1);
+    while (ctx -> dirs[i].path && (strncmp(ctx -> dirs[i].path, path, len) || ctx -> dirs[i].path[len])){
+        i = (i + 1) & (ctx -> buckets - 1);
+    }
+    return &ctx -> dirs[i];
+}
+
+static int extract_ctx_grow(struct tar_extract_ctx * ctx){
+    struct tar_dir * old = ctx -> dirs;
+    const unsigned int buckets = ctx -> buckets;
+
+    if (!(ctx -> dirs = calloc(buckets * 2, sizeof(struct tar_dir)))){
+        ctx -> dirs = old;
+        return -1;
+    }
+    ctx -> buckets = buckets * 2;
+
+    for(unsigned int i = 0; i < buckets; i++){
+        if (old[i].path){
+            *extract_ctx_slot(ctx, old[i].path, strlen(old[i].path)) = old[i];
+        }
+    }
+    free(old);
+
+    return 0;
+}
+
+// length of the directory part of a name, without the final '/'
+static size_t parent_length(const char * name, size_t len){
+    while (len && (name[len - 1] != '/')){
+        len--;
+    }
+    while (len && (name[len - 1] == '/')){
+        len--;
+    }
+    return len;
+}
+
+int extract_dir(struct tar_extract_ctx * ctx, const char * path, size_t len, const char verbosity){
+    while (len && (path[len - 1] == '/')){
+        len--;
+    }
+
+    if (!len){
+        return AT_FDCWD;
+    }
+
+    // already created or found earlier
+    struct tar_dir * dir = extract_ctx_slot(ctx, path, len);
+    if (dir -> path){
+        if (dir -> fd < 0){
+            if ((dir -> fd = STATS_TIME(LAT_OPEN, open(dir -> path, O_RDONLY | O_DIRECTORY))) < 0){
+                RC_ERROR("Unable to open directory %s: %s", dir -> path, strerror(rc));
+            }
+            ctx -> open++;
+        }
+        return dir -> fd;
+    }
+
+    const int parent = extract_dir(ctx, path, parent_length(path, len), verbosity);
+    if (parent == -1){
+        return -1;
+    }
+
+    size_t base = len;
+    while (base && (path[base - 1] != '/')){
+        base--;
+    }
+
+    char * name = strndup(path + base, len - base);
+    int fd = -1;
+    if ((STATS_TIME(LAT_MKDIR, mkdirat(parent, name, DEFAULT_DIR_MODE)) < 0) && (errno != EEXIST)){
+        const int rc = errno;
+        fprintf(stderr, "Error: Could not create directory %.*s: %s\n", (int) len, path, strerror(rc));
+    }
+    else if ((fd = STATS_TIME(LAT_OPEN, openat(parent, name, O_RDONLY | O_DIRECTORY))) < 0){
+        const int rc = errno;
+        fprintf(stderr, "Error: Unable to open directory %.*s: %s\n", (int) len, path, strerror(rc));
+    }
+    free(name);
+
+    if (fd < 0){
+        return -1;
+    }
+
+    // parents were added first, so the table may have moved
+    if (((ctx -> count + 1) * 2 > ctx -> buckets) && (extract_ctx_grow(ctx) < 0)){
+        close(fd);
+        ERROR("Unable to grow directory cache");
+    }
+
+    dir = extract_ctx_slot(ctx, path, len);
+    dir -> path = strndup(path, len);
+    dir -> fd = fd;
+    ctx -> count++;
+    ctx -> open++;
+
+    return fd;
+}
+
+// deepest directories first
+static int compare_depth(const void * a, const void * b){
+    int x = 0, y = 0;
+    for(const char * c = (*(struct tar_dir * const *) a) -> path; *c; c++){
+        x += *c == '/';
+    }
+    for(const char * c = (*(struct tar_dir * const *) b) -> path; *c; c++){
+        y += *c == '/';
+    }
+    return y - x;
+}
+
+int extract_ctx_finish(struct tar_extract_ctx * ctx){
+    struct tar_dir ** dirs = calloc(ctx -> count + 1, sizeof(struct tar_dir *));
+    int count = 0;
+    for(unsigned int i = 0; i < ctx -> buckets; i++){
+        if (ctx -> dirs[i].path && ctx -> dirs[i].restore){
+            dirs[count++] = &ctx -> dirs[i];
+        }
+    }
+
+    // children are done before their parents can become read only
+    qsort(dirs, count, sizeof(struct tar_dir *), compare_depth);
+
+    for(int i = 0; i < count; i++){
+        struct tar_dir * dir = dirs[i];
+        const int fd = (dir -> fd >= 0)?dir -> fd:open(dir -> path, O_RDONLY | O_DIRECTORY);
+        if (fd < 0){
+            restore_warn("metadata", dir -> path);
+            continue;
+        }
+
+        restore_metadata(fd, dir -> path, dir -> uid, dir -> gid, dir -> mode, dir -> mtime);
+        if (fd != dir -> fd){
+            close(fd);
+        }
+        dir -> restore = 0;
+    }
+    free(dirs);
+
+    return 0;
+}
+
+int extract_entry(const int fd, struct tar_t * entry, const char verbosity){
+    struct tar_extract_ctx ctx;
+    if (extract_ctx_init(&ctx) < 0){
+        ERROR("Unable to allocate directory cache");
+    }
+
+    const int ret = extract_entry_ctx(&ctx, fd, entry, verbosity);
+    extract_ctx_finish(&ctx);
+    extract_ctx_free(&ctx);
+
+    return ret;
+}
+
+int extract_entry_ctx(struct tar_extract_ctx * ctx, const int fd, struct tar_t * entry, const char verbosity){
+    const char * path = tar_entry_name(entry);
+    V_PRINT(stdout, "%s", path);
+    stats_add(STAT_ENTRIES, 1);
+    extract_ctx_trim(ctx);
+
+    const size_t len = strlen(path);
+    if (!len){
+        ERROR("Attempted to extract entry with empty name");
+    }
+
+    if (entry -> type == DIRECTORY){
+        if (extract_dir(ctx, path, len, verbosity) == -1){
+            return -1;
+        }
+
+        // applied once nothing more is created inside
+        size_t dirlen = len;
+        while (dirlen && (path[dirlen - 1] == '/')){
+            dirlen--;
+        }
+        struct tar_dir * dir = extract_ctx_slot(ctx, path, dirlen);
+        if (dir -> path){
+            dir -> restore = 1;
+            dir -> mode = tar_get_mode(entry) & 07777 & ~ctx -> umask;
+            dir -> uid = tar_entry_uid(entry);
+            dir -> gid = tar_entry_gid(entry);
+            dir -> mtime = tar_get_mtime(entry);
+        }
+        return 0;
+    }
+
+    if ((entry -> type == REGULAR) || (entry -> type == NORMAL) || (entry -> type == CONTIGUOUS)){
+        // create file next to its parent's descriptor
+        const int dir = extract_dir(ctx, path, parent_length(path, len), verbosity);
+        if (dir == -1){
+            return -1;
+        }
+
+        size_t base = len;
+        while (base && (path[base - 1] != '/')){
+            base--;
+        }
+
+        const unsigned int size = tar_get_size(entry);
+        int f = STATS_TIME(LAT_OPEN, openat(dir, path + base, O_WRONLY | O_CREAT | O_TRUNC, tar_get_mode(entry) & 0777));
+        if (f < 0){
+            RC_ERROR("Unable to open file %s: %s", path, strerror(rc));
+        }
+
+        // move archive pointer to data location
+        // a pipe being walked is already there
+        if ((stats_lseek(fd, 512 + entry -> begin, SEEK_SET) == (off_t) (-1)) && (errno != ESPIPE)){
+            RC_ERROR("Bad index: %s", strerror(rc));
+        }
+
+        // copy data to file
+        char buf[65536];
+        int got = 0;
+        while (got < size){
+            int r;
+            if ((r = read_size(fd, buf, MIN(size - got, sizeof(buf)))) <= 0){
+                RC_ERROR("Unable to read from archive: %s", strerror(rc));
+            }
+
+            if (write(f, buf, r) != r){
+                RC_ERROR("Unable to write to %s: %s", path, strerror(rc));
+            }
+
+            got += r;
+        }
+
+        restore_entry(f, entry);
+        close(f);
+    }
+
+    return 0;
+}
+
+
+// files of a batch submitted to io_uring, for the finish callback
+struct batch_files {
+    struct extract_batch * batch;
+    struct uring_file * files;
+    int * index;                            // batch entry of each file
+};
+
+static int batch_finish(const int fd, struct uring_file * file, void * arg){
+    const struct batch_files * submitted = arg;
+    return restore_entry(fd, &submitted -> batch -> entries[submitted -> index[file - submitted -> files]]);
+}
+
+// write out all batched entries with a few io_uring submissions
+// entries that fail are retried with extract_entry
+static int batch_flush(const int fd, struct extract_batch * batch, const char verbosity){
+    if (!batch -> count){
+        return 0;
+    }
+
+    int ret = 0;
+    struct tar_extract_ctx * ctx = batch -> ctx;
+    struct uring_file files[URING_BATCH];
+    char names[URING_BATCH][101];
+    int index[URING_BATCH];                 // batch entry of each file
+    char done[URING_BATCH] = {0};
+    memset(files, 0, sizeof(files));
+
+    // entries are in archive order, so one read covers all of their data
+    const struct tar_t * end = &batch -> entries[batch -> count - 1];
+    const off_t first = (off_t) batch -> entries[0].begin + 512;
+    const off_t last = (off_t) end -> begin + 512 + tar_get_size(end);
+    char * span = malloc(last - first + 1);
+
+    extract_ctx_trim(ctx);
+
+    int count = 0;
+    if (pread_size(fd, span, last - first, first) == last - first){
+        for(int i = 0; i < batch -> count; i++){
+            struct tar_t * entry = &batch -> entries[i];
+            const size_t len = strnlen(entry -> name, 100);
+            const size_t parent = parent_length(entry -> name, len);
+            const int dir = extract_dir(ctx, entry -> name, parent, verbosity);
+            if (!len || (dir == -1)){
+                continue;
+            }
+
+            memcpy(names[count], entry -> name, len);
+            names[count][len] = '\0';
+            files[count].path = names[count] + (parent?(parent + 1):0);
+            while (*files[count].path == '/'){
+                files[count].path++;
+            }
+            files[count].dirfd = dir;
+            files[count].flags = O_WRONLY | O_CREAT | O_TRUNC;
+            files[count].mode = tar_get_mode(entry) & 0777;
+            files[count].data = span + ((off_t) entry -> begin + 512 - first);
+            files[count].size = tar_get_size(entry);
+            index[count++] = i;
+        }
+
+        struct batch_files submitted = { batch, files, index };
+        if (uring_write_files(files, count, batch_finish, &submitted) == 0){
+            for(int i = 0; i < count; i++){
+                if (!files[i].result){
+                    V_PRINT(stdout, "%s", names[i]);
+                    stats_add(STAT_ENTRIES, 1);
+                    done[index[i]] = 1;
+                }
+            }
+        }
+    }
+    free(span);
+
+    // anything the batch could not handle goes through the normal path
+    for(int i = 0; i < batch -> count; i++){
+        if (!done[i] && (extract_entry_ctx(ctx, fd, &batch -> entries[i], verbosity) < 0)){
+            ret = -1;
+        }
+    }
+
+    batch -> count = 0;
+    return ret;
+}
+
+// extract an entry, batching small files when io_uring is in use
+// call batch_flush once all entries have been passed in
+static int batch_extract(const int fd, struct tar_t * entry, struct extract_batch * batch, const char verbosity){
+    const unsigned int size = tar_get_size(entry);
+    const char batchable = tar_opts.uring && uring_available() &&
+                           ((entry -> type == REGULAR) || (entry -> type == NORMAL) || (entry -> type == CONTIGUOUS)) &&
+                           (size <= URING_FILE_MAX) && !entry -> long_name;
+    int ret = 0;
+
+    // keep the batch in archive order and never write the same name twice in one batch
+    // (entries with long names are not batched: their names may belong to an iterator)
+    // the batch is read in one piece, so skipped members between its entries count against the limit
+    if (batch -> count){
+        char flush = !batchable || (batch -> count == URING_BATCH) ||
+                     (entry -> begin < batch -> entries[batch -> count - 1].begin) ||
+                     ((off_t) entry -> begin + 512 + size - (off_t) batch -> entries[0].begin > URING_BATCH_BYTES);
+        for(int i = 0; !flush && (i < batch -> count); i++){
+            flush = !strncmp(batch -> entries[i].name, entry -> name, 100);
+        }
+
+        if (flush && (batch_flush(fd, batch, verbosity) < 0)){
+            ret = -1;
+        }
+    }
+
+    if (!batchable){
+        return (extract_entry_ctx(batch -> ctx, fd, entry, verbosity) < 0)?-1:ret;
+    }
+
+    batch -> entries[batch -> count++] = *entry;
+    return ret;
+}
+
+//States difference between archive and file system
+int tar_diff(FILE * f, struct tar_t * archive, const char verbosity){
+    STATS_PHASE(PHASE_DIFF);
+
+    struct stat st;
+    while (archive){
+        const char * name = tar_entry_name(archive);
+        V_PRINT(stdout,"%s", name);
+
+        // if not found, print error
+        if (stats_stat(name, &st)){
+            int rc = errno;
+            printf("Could not ");
+            if (archive -> type == SYMLINK){
+                printf("readlink");
+            }
+            else{
+                printf("stat");
+            }
+            printf(" %s: %s", name, strerror(rc));
+        }
+        else{
+
+            if (st.st_mtime != tar_get_mtime(archive)){
+//                struct tm dt = *(gmtime(&st.st_mtime));
+                printf("%s: Modification time differs\n", name);
+//                printf("Modified on : %d-%d-%d %d:%d:%d\n", dt.tm_mday,dt.tm_mon,dt.tm_year+1900,dt.tm_hour,dt.tm_min,dt.tm_sec);
+            }
+            if (st.st_size != tar_get_size(archive)){
+                printf("%s: size differs \n", name);
+            }
+            if (st.st_mode != tar_get_mode(archive)){
+                printf("%s: Mode differs", name);
+            }
+
+        }
+        printf("\n");
+        printf("\n");
+        archive = archive -> next;
+    }
+    return 0;
+}
+
+
+// shared state of verify workers
+struct verify_job {
+    int fd;
+    struct tar_t ** entries;
+    char * status;                          // per entry result: 0 ok, 1 bad header, 2 bad digest, 3 read error, 4 no digest
+    int count;
+    int next;                               // next entry to claim
+};
+
+// check the header checksum of an entry without modifying it
+static int header_valid(struct tar_t * entry){
+    unsigned int check = 0;
+    for(int i = 0; i < 512; i++){
+        check += (unsigned char) entry -> block[i];
+    }
+
+    // checksum field counts as spaces
+    for(int i = 0; i < 8; i++){
+        check += ' ' - (unsigned char) entry -> check[i];
+    }
+
+    // numeric fields of the layout hold octal digits padded with spaces or NULs
+    const int layout = tar_header_layout(entry);
+    int valid = check == tar_get_check(entry);
+    #define FIELD_VALID(field, first)                                                       \
+        for(size_t i = 0; (layout >= first) && (i < sizeof(entry -> field)); i++){          \
+            const char c = entry -> field[i];                                               \
+            valid &= ((c >= '0') && (c <= '7')) || (c == ' ') || !c;                        \
+        }
+    TAR_NUMERIC_FIELDS(FIELD_VALID)
+    #undef FIELD_VALID
+
+    return valid;
+}
+
+static void * verify_worker(void * arg){
+    struct verify_job * job = arg;
+    char * buf = malloc(65536);
+
+    int i;
+    while ((i = __atomic_fetch_add(&job -> next, 1, __ATOMIC_RELAXED)) < job -> count){
+        struct tar_t * entry = job -> entries[i];
+
+        if (!header_valid(entry)){
+            job -> status[i] = 1;
+            continue;
+        }
+
+        if (entry -> digest != DIGEST_CRC32C){
+            job -> status[i] = 4;
+            continue;
+        }
+
+        // stream the data straight from the archive without moving the shared offset
+        const unsigned int size = tar_get_size(entry);
+        unsigned int got = 0, crc = 0;
+        while (got < size){
+            const int want = MIN(size - got, 65536);
+            if (pread_size(job -> fd, buf, want, (off_t) entry -> begin + 512 + got) != want){
+                break;
+            }
+            crc = tar_crc32c(crc, buf, want);
+            got += want;
+        }
+
+        if (got < size){
+            job -> status[i] = 3;
+        }
+        else{
+            job -> status[i] = (crc == entry -> crc32c)?0:2;
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+// verify every entry without extracting
+// returns number of damaged entries
+int tar_verify(const int fd, struct tar_t * archive, int threads, const char verbosity){
+    if (fd < 0){
+        ERROR("Bad file descriptor");
+    }
+
+    if (threads < 1){
+        threads = 1;
+    }
+
+    struct verify_job job = { fd, NULL, NULL, 0, 0 };
+    for(struct tar_t * entry = archive; entry; entry = entry -> next){
+        job.count++;
+    }
+
+    job.entries = calloc(job.count + 1, sizeof(struct tar_t *));
+    job.status = calloc(job.count + 1, sizeof(char));
+    int i = 0;
+    for(struct tar_t * entry = archive; entry; entry = entry -> next){
+        job.entries[i++] = entry;
+    }
+
+    // workers claim entries one at a time; large members do not hold up small ones
+    pthread_t * workers = calloc(threads, sizeof(pthread_t));
+    int started = 0;
+    while ((started < threads) && (started < job.count) && !pthread_create(&workers[started], NULL, verify_worker, &job)){
+        started++;
+    }
+
+    // fall back to verifying on this thread
+    if (!started){
+        verify_worker(&job);
+    }
+
+    for(i = 0; i < started; i++){
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    int bad = 0;
+    for(i = 0; i < job.count; i++){
+        switch (job.status[i]){
+            case 0:
+                V_PRINT(stdout, "%s: OK", tar_entry_name(job.entries[i]));
+                break;
+            case 1:
+                printf("%s: Header checksum mismatch\n", tar_entry_name(job.entries[i]));
+                bad++;
+                break;
+            case 2:
+                printf("%s: Data digest mismatch\n", tar_entry_name(job.entries[i]));
+                bad++;
+                break;
+            case 3:
+                printf("%s: Unable to read data\n", tar_entry_name(job.entries[i]));
+                bad++;
+                break;
+            case 4:
+                V_PRINT(stdout, "%s: No digest", tar_entry_name(job.entries[i]));
+                break;
+        }
+    }
+
+    free(job.entries);
+    free(job.status);
+
+    return bad;
+}
+
+// members larger than this are searched in pieces so that one large log is spread over all threads
+#define SEARCH_UNIT (8 * 1024 * 1024)
+
+// member data read at once by a search worker
+#define SEARCH_READ (1024 * 1024)
+
+// part of a member searched by one worker
+struct search_unit {
+    struct tar_t * entry;
+    unsigned int start, end;                // payload range; matches must start inside it
+    unsigned long long * hits;              // payload offsets of matches, in order
+    int count, space;
+    char failed;
+};
+
+struct search_job {
+    int fd;
+    const char * pattern;
+    size_t len;
+    regex_t * regex;                        // NULL when searching for a fixed string; each worker compiles its own copy
+    struct search_unit * units;
+    int count;
+    int next;                               // next unit to claim
+};
+
+static void search_hit(struct search_unit * unit, const unsigned long long offset){
+    if (unit -> count == unit -> space){
+        unit -> space = unit -> space?(2 * unit -> space):16;
+        unit -> hits = realloc(unit -> hits, unit -> space * sizeof(unsigned long long));
+    }
+    unit -> hits[unit -> count++] = offset;
+}
+
+// match the regular expression against each complete line of buf (base is the payload offset of buf)
+// returns the length of the incomplete last line, which is searched once the rest of it was read
+static size_t search_lines(const regex_t * regex, struct search_unit * unit, const char * buf, const size_t have, const unsigned long long base, const char last){
+    size_t line = 0;
+    while (line < have){
+        const char * nl = memchr(buf + line, '\n', have - line);
+
+        // lines that do not fit in the buffer are searched in pieces
+        if (!nl && !last && line && (have - line <= SEARCH_READ)){
+            return have - line;
+        }
+
+        const size_t end = nl?(size_t) (nl - buf):have;
+        regmatch_t match = { .rm_so = line, .rm_eo = end };
+        if (!regexec(regex, buf, 1, &match, REG_STARTEND)){
+            search_hit(unit, base + match.rm_so);
+        }
+        line = end + 1;
+    }
+    return 0;
+}
+
+static void * search_worker(void * arg){
+    struct search_job * job = arg;
+
+    // room for the data being read and what is carried over from the previous read
+    char * buf = malloc(2 * SEARCH_READ);
+
+    // regexec locks the regex_t it is given, so sharing one would serialize the workers
+    regex_t compiled;
+    const regex_t * regex = job -> regex;
+    if (regex && !regcomp(&compiled, job -> pattern, REG_EXTENDED | REG_NEWLINE)){
+        regex = &compiled;
+    }
+
+    int i;
+    while (buf && ((i = __atomic_fetch_add(&job -> next, 1, __ATOMIC_RELAXED)) < job -> count)){
+        struct search_unit * unit = &job -> units[i];
+        const off_t data = (off_t) unit -> entry -> begin + 512;
+
+        // a fixed string starting near the end of the unit may run into the next one
+        const unsigned int size = tar_get_size(unit -> entry);
+        const unsigned int stop = job -> regex?unit -> end:MIN(size, unit -> end + job -> len - 1);
+
+        unsigned long long base = unit -> start;    // payload offset of buf[0]
+        unsigned int pos = unit -> start;           // next payload byte to read
+        size_t have = 0;
+        while (pos < stop){
+            const int want = MIN(stop - pos, SEARCH_READ);
+            if (pread_size(job -> fd, buf + have, want, data + pos) != want){
+                unit -> failed = 1;
+                break;
+            }
+            pos += want;
+            have += want;
+
+            size_t keep;
+            if (job -> regex){
+                keep = search_lines(regex, unit, buf, have, base, pos == stop);
+            }
+            else{
+                for(const char * p = buf; (p = memmem(p, buf + have - p, job -> pattern, job -> len)); p++){
+                    if (base + (p - buf) >= unit -> end){
+                        break;
+                    }
+                    search_hit(unit, base + (p - buf));
+                }
+
+                // anything shorter than the pattern may still be the start of a match
+                keep = (pos == stop)?0:MIN(have, job -> len - 1);
+            }
+
+            memmove(buf, buf + have - keep, keep);
+            base += have - keep;
+            have = keep;
+        }
+    }
+    free(buf);
+
+    if (regex == &compiled){
+        regfree(&compiled);
+    }
+
+    return NULL;
+}
+
+int tar_search(const int fd, struct tar_t * archive, int filecount, const char * files[], const char * pattern, const char regex, int threads, const char verbosity){
+    if (fd < 0){
+        ERROR("Bad file descriptor");
+    }
+
+    if (!pattern || !*pattern){
+        ERROR("Empty search pattern");
+    }
+
+    if (threads < 1){
+        threads = 1;
+    }
+
+    struct search_job job = { fd, pattern, strlen(pattern), NULL, NULL, 0, 0 };
+    if (!regex && (job.len >= SEARCH_READ)){
+        ERROR("Search pattern too long");
+    }
+
+    regex_t compiled;
+    if (regex){
+        const int rc = regcomp(&compiled, pattern, REG_EXTENDED | REG_NEWLINE);
+        if (rc){
+            char msg[256];
+            regerror(rc, &compiled, msg, sizeof(msg));
+            ERROR("Bad regular expression: %s", msg);
+        }
+        job.regex = &compiled;
+    }
+
+    struct matcher m;
+    if (tar_matcher(&m, filecount, files) < 0){
+        if (regex){
+            regfree(&compiled);
+        }
+        ERROR("Unable to compile file list");
+    }
+
+    // regular expressions match whole lines, so members are only split for fixed strings
+    const unsigned int unit_size = regex?UINT_MAX:SEARCH_UNIT;
+    for(int pass = 0; pass < 2; pass++){
+        job.count = 0;
+        for(struct tar_t * entry = archive; entry; entry = entry -> next){
+            if (((entry -> type != REGULAR) && (entry -> type != NORMAL) && (entry -> type != CONTIGUOUS)) ||
+                (matcher_match(&m, tar_entry_name(entry), NULL) < 0)){
+                continue;
+            }
+
+            const unsigned int size = tar_get_size(entry);
+            for(unsigned int start = 0; start < size; start += MIN(size - start, unit_size)){
+                if (pass){
+                    job.units[job.count].entry = entry;
+                    job.units[job.count].start = start;
+                    job.units[job.count].end = start + MIN(size - start, unit_size);
+                }
+                job.count++;
+            }
+        }
+
+        if (!pass){
+            job.units = calloc(job.count + 1, sizeof(struct search_unit));
+        }
+    }
+    matcher_free(&m);
+
+    // workers claim units one at a time, like tar_verify
+    pthread_t * workers = calloc(threads, sizeof(pthread_t));
+    int started = 0;
+    while ((started < threads) && (started < job.count) && !pthread_create(&workers[started], NULL, search_worker, &job)){
+        started++;
+    }
+
+    // fall back to searching on this thread
+    if (!started){
+        search_worker(&job);
+    }
+
+    for(int i = 0; i < started; i++){
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    // hits are reported in archive order
+    int hits = 0, ret = 0;
+    for(int i = 0; i < job.count; i++){
+        struct search_unit * unit = &job.units[i];
+        for(int h = 0; h < unit -> count; h++){
+            printf("%s:%llu\n", tar_entry_name(unit -> entry), unit -> hits[h]);
+        }
+        hits += unit -> count;
+
+        if (unit -> failed){
+            fprintf(stderr, "Error: Unable to read %s\n", tar_entry_name(unit -> entry));
+            ret = -1;
+        }
+        free(unit -> hits);
+    }
+    free(job.units);
+
+    if (regex){
+        regfree(&compiled);
+    }
+
+    return ret?ret:hits;
+}
+
+int recursive_mkdir(const char * dir, const unsigned int mode, const char verbosity){
+    const size_t len = strlen(dir);
+
+    if (!len){
+        return 0;
+    }
+
+    char * path = calloc(len + 1, sizeof(char));
+    strncpy(path, dir, len);
+
+    // create each component in turn; ones that already exist are fine
+    for(size_t i = 1; i <= len; i++){
+        if ((path[i] != '/') && path[i]){
+            continue;
+        }
+
+        const char c = path[i];
+        path[i] = '\0';
+        if ((path[i - 1] != '/') && (STATS_TIME(LAT_MKDIR, MKDIR(path, mode)) < 0) && (errno != EEXIST)){
+            const int rc = errno;
+            fprintf(stderr, "Error: Could not create directory %s: %s\n", path, strerror(rc));
+            free(path);
+            return -1;
+        }
+        path[i] = c;
+    }
+
+    free(path);
+    return 0;
+}
+
+int tar_remove(const int fd, struct tar_t ** archive, int filecount, const char * files[], const char verbosity){
+    STATS_PHASE(PHASE_REMOVE);
+
+    if (fd < 0){
+        return -1;
+    }
+
+    // archive has to exist
+    if (!archive || !*archive){
+        ERROR("Got bad archive");
+    }
+
+    if (filecount && !files){
+        ERROR("Non-zero file count provided, but file list is NULL");
+    }
+
+    if (!filecount){
+        V_PRINT(stderr, "No entries specified");
+        return 0;
+    }
+
+
+
+    // find first file to be removed that does not exist
+    int ret = 0;
+    for(int i = 0; i < filecount; i++){
+        if (!exists(*archive, files[i], 0)){
+            ERROR("'%s' not found in archive", files[i]);
+        }
+    }
+
+    // kept entries are moved in runs of adjacent members
+    unsigned int read_offset = 0;       // start of the current run
+    unsigned int run = 0;               // length of the current run
+    unsigned int write_offset = 0;
+    struct tar_t * prev = NULL;
+    struct tar_t * curr = *archive;
+    while(curr){
+        // get original size
+        int total = curr -> extended + 512;
+
+        if ((curr -> type == REGULAR) || (curr -> type == NORMAL)){
+            total += tar_get_size(curr);
+            if (total % 512){
+                total += 512 - (total % 512);
+            }
+        }
+
+        const int match = check_match(curr, filecount, files);
+
+        if (match < 0){
+            ERROR("Match failed");
+        }
+   else if (!match){
+            // entry will end up right after the entries already kept
+            curr -> begin = write_offset + run + curr -> extended;
+            run += total;
+
+            prev = curr;
+            curr = curr -> next;
+        }
+
+        else{// if name matches, skip the data
+            // move the run that ended here into place
+            if (move_range(fd, read_offset, write_offset, run) < 0){
+                ERROR("Unable to move entries");
+            }
+            write_offset += run;
+            read_offset += run + total;
+            run = 0;
+
+            struct tar_t * tmp = curr;
+            if (!prev){
+                *archive = curr -> next;
+            }
+            else{
+                prev -> next = curr -> next;
+            }
+            curr = curr -> next;
+            free(tmp);
+        }
+    }
+
+    if (move_range(fd, read_offset, write_offset, run) < 0){
+        ERROR("Unable to move entries");
+    }
+    write_offset += run;
+
+    // resize file
+    if (ftruncate(fd, write_offset) < 0){
+        RC_ERROR("Could not truncate file: %s", strerror(rc));
+    }
+
+    // terminate the shortened archive again
+    if (stats_lseek(fd, write_offset, SEEK_SET) == (off_t) (-1)){
+        RC_ERROR("Cannot seek: %s", strerror(rc));
+    }
+
+    if (write_end_data(fd, write_offset, verbosity) < 0){
+        ERROR("Failed to write end data");
+    }
+
+    return ret;
+}
+
+// check if entry is a match for any of the given file names
+// returns index + 1 if match is found
+int check_match(struct tar_t * entry, int filecount, const char * files[]){
+    if (!entry){
+        return -1;
+    }
+
+    if (!filecount){
+        return 0;
+    }
+
+    if (filecount && !files){
+        return -1;
+    }
+
+    for(int i = 0; i < filecount; i++){
+        if (!strcmp(tar_entry_name(entry), files[i])){
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+// file metadata and contents fetched ahead through io_uring while a directory is archived
+struct prefetch {
+    struct uring_file files[URING_BATCH];
+    char statted[URING_BATCH];              // st of the file is valid
+    int count;
+    struct prefetch * parent;               // window of the enclosing directory
+};
+
+// innermost window of the directory being archived on this thread
+static __thread struct prefetch * prefetched;
+
+// excluded patterns while archiving on this thread (NULL if there are none)
+static __thread const struct matcher * excluding;
+
+// directories are written without their contents (their members are listed separately)
+static __thread char shallow;
+
+// names of the members an interrupted run wrote before its last checkpoint
+struct name_set {
+    const char ** slots;
+    unsigned int buckets;                   // power of 2, at least twice the number of names
+};
+
+static __thread const struct name_set * resumed;
+
+static const char ** name_set_find(const struct name_set * set, const char * name){
+    unsigned int i = name_hash(name, strlen(name)) & (set -> buckets - 1);
+    while (set -> slots[i] && strcmp(set -> slots[i], name)){
+        i = (i + 1) & (set -> buckets - 1);
+    }
+    return &set -> slots[i];
+}
+
+static int name_set_init(struct name_set * set, struct tar_t * archive){
+    unsigned int count = 0;
+    for(struct tar_t * entry = archive; entry; entry = entry -> next){
+        count++;
+    }
+
+    set -> buckets = 16;
+    while (set -> buckets < 2 * count){
+        set -> buckets *= 2;
+    }
+    if (!(set -> slots = calloc(set -> buckets, sizeof(char *)))){
+        return -1;
+    }
+
+    for(struct tar_t * entry = archive; entry; entry = entry -> next){
+        *name_set_find(set, tar_entry_name(entry)) = tar_entry_name(entry);
+    }
+    return 0;
+}
+
+static void prefetch_clear(struct prefetch * window){
+    for(int i = 0; i < window -> count; i++){
+        free(window -> files[i].data);
+    }
+    memset(window -> files, 0, sizeof(window -> files));
+    memset(window -> statted, 0, sizeof(window -> statted));
+    window -> count = 0;
+}
+
+// stat the next few children of a directory and read the small ones, all in a few submissions
+static void prefetch_fill(struct prefetch * window, char ** paths, const int count){
+    prefetch_clear(window);
+
+    for(int i = 0; i < count; i++){
+        window -> files[i].path = paths[i];
+        window -> files[i].dirfd = AT_FDCWD;
+    }
+
+    if (uring_stat_files(window -> files, count) < 0){
+        return;
+    }
+    window -> count = count;
+
+    // only small files are read ahead, and not too much at once
+    unsigned int bytes = 0;
+    for(int i = 0; i < count; i++){
+        struct uring_file * file = &window -> files[i];
+        window -> statted[i] = !file -> result;
+        if (file -> result){
+            continue;
+        }
+
+        if (S_ISREG(file -> st.st_mode) && (file -> st.st_size <= URING_FILE_MAX) && (bytes + file -> st.st_size <= URING_BATCH_BYTES)){
+            bytes += file -> st.st_size;
+        }
+        else{
+            file -> result = -EFBIG;
+        }
+    }
+
+    uring_read_files(window -> files, count);
+}
+
+static int prefetch_find(const char * path){
+    for(int i = 0; prefetched && (i < prefetched -> count); i++){
+        if (!strcmp(prefetched -> files[i].path, path)){
+            return i;
+        }
+    }
+    return -1;
+}
+
+// stat a file, using the prefetched result if there is one
+static int prefetched_stat(const char * path, struct stat * st){
+    const int i = prefetch_find(path);
+    if ((i >= 0) && prefetched -> statted[i]){
+        *st = prefetched -> files[i].st;
+        return 0;
+    }
+    return stats_stat(path, st);
+}
+
+// contents of a file if they were read ahead
+static const struct uring_file * prefetched_data(const char * path){
+    const int i = prefetch_find(path);
+    if ((i >= 0) && !prefetched -> files[i].result && prefetched -> files[i].data){
+        return &prefetched -> files[i];
+    }
+    return NULL;
+}
+
+// low impact mode writes archive data back and drops it from the cache in chunks this large
+#define RELEASE_CHUNK (8 * 1024 * 1024)
+
+// source files are copied through this buffer; aligned so it can be used with O_DIRECT
+#define SOURCE_CHUNK (64 * 1024)
+static __thread char source_buf[SOURCE_CHUNK] __attribute__((aligned(4096)));
+
+// archive offset before which written data has already been dropped from the cache
+static __thread off_t released;
+
+// in low impact mode, flush archive data written since the last call and drop it from the page cache
+// does nothing until a full chunk is pending, unless all is set
+static void release_archive(const int fd, const off_t end, const char all){
+    if (!tar_opts.low_impact || (!all && (end - released < RELEASE_CHUNK))){
+        return;
+    }
+    coalesce_flush();
+
+#ifdef SYNC_FILE_RANGE_WRITE
+    sync_file_range(fd, released, all?0:(end - released), SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+    fdatasync(fd);
+#endif
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, released, all?0:(end - released), POSIX_FADV_DONTNEED);
+#endif
+    released = end;
+}
+
+// open a file that is about to be archived, bypassing or sparing the page cache if asked to
+static int open_source(const char * path){
+    int f = -1;
+#ifdef O_DIRECT
+    if (tar_opts.direct){
+        f = STATS_TIME(LAT_OPEN, open(path, O_RDONLY | O_DIRECT));
+    }
+#endif
+    if (f < 0){
+        f = STATS_TIME(LAT_OPEN, open(path, O_RDONLY));
+    }
+
+#ifdef POSIX_FADV_NOREUSE
+    if ((f >= 0) && tar_opts.low_impact){
+        posix_fadvise(f, 0, 0, POSIX_FADV_NOREUSE);
+    }
+#endif
+
+    return f;
+}
+
+// offset right after the last member, where the end of archive blocks start
+static off_t archive_end(const struct tar_t * archive){
+    if (!archive){
+        return 0;
+    }
+
+    while (archive -> next){
+        archive = archive -> next;
+    }
+
+    unsigned int jump = 512 + tar_get_size(archive);
+    if (jump % 512){
+        jump += 512 - (jump % 512);
+    }
+    return (off_t) archive -> begin + jump;
+}
+
+//writing
+int tar_write(const int fd, struct tar_t ** archive,int filecount, const char * files[], const char verbosity){
+    STATS_PHASE(PHASE_WRITE);
+
+    if (fd < 0){
+        ERROR("Bad file descriptor");
+    }
+
+    if (!archive){
+        ERROR("Bad archive");
+    }
+
+    // where file descriptor offset is
+    int offset = 0;
+
+    // an interrupted run is cut back to its last checkpoint, and what it wrote until then is kept
+    struct name_set done = { NULL, 0 };
+    const char * checkpoint = shallow?NULL:tar_opts.checkpoint;
+    if (checkpoint && tar_opts.resume && !*archive){
+        const off_t at = checkpoint_load(checkpoint);
+        if (at > 0){
+            if ((ftruncate(fd, at) < 0) || (stats_lseek(fd, at, SEEK_SET) == (off_t) (-1)) ||
+                (write_end_data(fd, at, 0) < 0) || (tar_read(fd, archive, 0) < 0) || (name_set_init(&done, *archive) < 0)){
+                ERROR("Unable to resume from %s", checkpoint);
+            }
+            resumed = &done;
+            V_PRINT(stdout, "Resuming %s at offset %lld", checkpoint, (long long) at);
+        }
+    }
+
+    // if there is old data
+    struct tar_t ** tar = archive;
+
+
+    if (*tar){
+        // skip to last entry
+        while (*tar && (*tar) -> next){
+            tar = &((*tar) -> next);
+
+        }
+
+        // move file descriptor past final entry
+        offset = archive_end(*tar);
+
+        if (stats_lseek(fd, offset, SEEK_SET) == (off_t) (-1)){
+            RC_ERROR("Unable to seek file: %s", strerror(rc));
+        }
+        tar = &((*tar) -> next);
+    }
+
+    released = offset;
+    if (checkpoint){
+        checkpoint_begin(checkpoint, offset);
+    }
+
+    // small members are written many at a time
+    struct coalesce gather = { fd, offset, 0, malloc(COALESCE_SIZE) };
+    coalescing = gather.data?&gather:NULL;
+
+    // excluded names are dropped before they are looked at, so excluded directories are never walked
+    struct matcher m;
+    if (tar_matcher(&m, 0, NULL) < 0){
+        ERROR("Unable to compile excluded patterns");
+    }
+    excluding = m.excludes?&m:NULL;
+
+    const char ** kept = calloc(filecount + 1, sizeof(char *));
+    int count = 0;
+    for(int i = 0; i < filecount; i++){
+        if (!excluding || (matcher_match(excluding, files[i], NULL) > 0)){
+            kept[count++] = files[i];
+        }
+    }
+
+    // write entries first
+    const int rc = write_entries(fd, tar, archive, count, kept, &offset, verbosity);
+    excluding = NULL;
+    resumed = NULL;
+    free(done.slots);
+    matcher_free(&m);
+    free(kept);
+
+    // the end of archive blocks go out with the last members
+    const int end = (rc < 0)?0:write_end_data(fd, offset, verbosity);
+    const int flushed = coalesce_flush();
+    coalescing = NULL;
+    free(gather.data);
+    if (rc < 0){
+        checkpoint_path = NULL;
+        ERROR("Failed to write entries");
+    }
+
+    if ((end < 0) || (flushed < 0)){
+        checkpoint_path = NULL;
+        ERROR("Failed to write end data");
+    }
+    release_archive(fd, offset, 1);
+    checkpoint_end();
+
+    // clear original names from data
+    tar = archive;
+    while (*tar){
+        memset((*tar) -> name, 0, 100);
+        tar = &((*tar) -> next);
+    }
+
+    return offset;
+
+}
+
+
+int tar_concatenate(const int fd, struct tar_t ** archive, int count, const char * sources[], const char verbosity){
+    STATS_PHASE(PHASE_WRITE);
+
+    if (fd < 0){
+        ERROR("Bad file descriptor");
+    }
+
+    if (!archive){
+        ERROR("Bad archive");
+    }
+
+    if (count && !sources){
+        ERROR("Non-zero archive count provided, but archive list is NULL");
+    }
+
+    struct tar_t ** tail = archive;
+    while (*tail){
+        tail = &((*tail) -> next);
+    }
+
+    // members are appended over the old end of archive blocks
+    off_t offset = archive_end(*archive);
+    int ret = 0;
+    for(int i = 0; (i < count) && !ret; i++){
+        const int src = STATS_TIME(LAT_OPEN, open(sources[i], O_RDONLY));
+        if (src < 0){
+            fprintf(stderr, "Error: Unable to open %s: %s\n", sources[i], strerror(errno));
+            ret = -1;
+            break;
+        }
+
+        struct tar_t * entries = NULL;
+        if (tar_read(src, &entries, verbosity) < 0){
+            fprintf(stderr, "Error: Unable to read %s\n", sources[i]);
+            ret = -1;
+        }
+
+        // everything up to the source's own end of archive is copied unchanged
+        const off_t size = archive_end(entries);
+        if (!ret && (offset + size > UINT_MAX)){
+            fprintf(stderr, "Error: Appending %s would make the archive too large\n", sources[i]);
+            ret = -1;
+        }
+
+        if (!ret && (copy_range(src, 0, fd, offset, size) < 0)){
+            fprintf(stderr, "Error: Unable to copy %s: %s\n", sources[i], strerror(errno));
+            ret = -1;
+        }
+        close(src);
+
+        if (ret){
+            tar_free(entries);
+            break;
+        }
+
+        V_PRINT(stdout, "%s", sources[i]);
+
+        // fix up the index for the new location
+        for(struct tar_t * entry = entries; entry; entry = entry -> next){
+            entry -> begin += offset;
+        }
+        *tail = entries;
+        while (*tail){
+            tail = &((*tail) -> next);
+        }
+        offset += size;
+    }
+
+    // terminate after the last complete member, even if a later source failed
+    if (stats_lseek(fd, offset, SEEK_SET) == (off_t) (-1)){
+        RC_ERROR("Unable to seek file: %s", strerror(rc));
+    }
+
+    const int end = write_end_data(fd, offset, verbosity);
+    if (end < 0){
+        ERROR("Failed to write end data");
+    }
+
+    if (ftruncate(fd, offset + end) < 0){
+        RC_ERROR("Could not truncate file: %s", strerror(rc));
+    }
+
+    return ret;
+}
+
+int write_entries(const int fd, struct tar_t ** archive, struct tar_t ** head, const size_t filecount, const char * files[], int * offset, const char verbosity){
+    if (fd < 0){
+        ERROR("Bad file descriptor");
+    }
+
+    if (!archive || *archive){
+        ERROR("Bad archive");
+    }
+
+    if (filecount && !files){
+        ERROR("Non-zero file count provided, but file list is NULL");
+    }
+
+    // add new data
+    struct tar_t ** tar = archive;  // current entry
+    for(unsigned int i = 0; i < filecount; i++){
+        // the original name and a long name are kept in the same allocation as the entry
+        const size_t namelen = strlen(files[i]);
+        *tar = malloc(sizeof(struct tar_t) + 2 * namelen + 3);
+        char * names = (char *) (*tar + 1);
+        memcpy(names, files[i], namelen + 1);
+
+        stats_add(STAT_ENTRIES, 1);
+
+        // stat file
+        if (format_tar_data(*tar, names, names + namelen + 1, verbosity) < 0){
+            ERROR("Failed to stat %s", files[i]);
+        }
+
+        (*tar) -> begin = *offset;
+
+        // members an interrupted run already wrote are not written again
+        const char skip = resumed && *name_set_find(resumed, tar_entry_name(*tar));
+        if (skip && ((*tar) -> type != DIRECTORY)){
+            free(*tar);
+            *tar = NULL;
+            continue;
+        }
+
+        // directories need special handling
+        if ((*tar) -> type == DIRECTORY){
+            // children are named after the source path
+            size_t len = namelen;
+            while ((len > 1) && (files[i][len - 1] == '/')){
+                len--;
+            }
+            char * parent = strndup(files[i], len);
+            struct tar_t ** slot = tar;
+
+            // (a directory already written only has its children looked at)
+            if (!skip){
+                V_PRINT(stdout, "Writing %s", tar_entry_name(*tar));
+
+                // write metadata to (*tar) file
+                off_t digest_at;
+                const int extended = write_header(fd, *tar, *offset, 0, &digest_at);
+                if (extended < 0){
+                    ERROR("Failed to write metadata to archive");
+                }
+                *offset += extended;
+                (*tar) -> begin = *offset;
+                (*tar) -> extended = extended;
+
+                // children are written right after the directory's metadata
+                *offset += 512;
+            }
+
+            if (shallow){
+                free(parent);
+                tar = &((*tar) -> next);
+                continue;
+            }
+
+            // go through directory
+            DIR * d = opendir(parent);
+            if (!d){
+                ERROR("Cannot open directory %s", parent);
+            }
+
+            // collect children first so they can be fetched ahead in batches
+            char ** children = NULL;
+            int count = 0, space = 0;
+            struct dirent * dir;
+            while ((dir = readdir(d))){
+                // if not special directories . and ..
+                const size_t sublen = strlen(dir -> d_name);
+                if (strncmp(dir -> d_name, ".", sublen) && strncmp(dir -> d_name, "..", sublen)){
+                    if (count == space){
+                        space = space?(2 * space):16;
+                        children = realloc(children, space * sizeof(char *));
+                    }
+
+                    children[count] = calloc(len + sublen + 2, sizeof(char));
+                    sprintf(children[count], "%s/%s", parent, dir -> d_name);
+
+                    // excluded children are neither fetched ahead nor visited
+                    if (excluding && (matcher_match(excluding, children[count], NULL) < 0)){
+                        free(children[count]);
+                        continue;
+                    }
+                    count++;
+                }
+            }
+            closedir(d);
+
+            struct prefetch * window = NULL;
+            // reading ahead would pull files into the cache that low impact mode keeps out
+            if (tar_opts.uring && !tar_opts.low_impact && uring_available()){
+                window = calloc(1, sizeof(struct prefetch));
+                window -> parent = prefetched;
+                prefetched = window;
+            }
+
+            int rc = 0;
+            for(int c = 0; (c < count) && !rc; c++){
+                if (window && !(c % URING_BATCH)){
+                    prefetch_fill(window, children + c, MIN(URING_BATCH, count - c));
+                }
+
+                // recursively write each subdirectory
+                rc = write_entries(fd, &((*tar) -> next), head, 1, (const char **) &children[c], offset, verbosity);
+
+                // go to end of new data
+                while ((*tar) -> next){
+                    tar = &((*tar) -> next);
+                }
+            }
+
+            if (window){
+                prefetch_clear(window);
+                prefetched = window -> parent;
+                free(window);
+            }
+
+            for(int c = 0; c < count; c++){
+                free(children[c]);
+            }
+            free(children);
+            free(parent);
+
+            if (rc < 0){
+                ERROR("Recurse error");
+            }
+
+            // the directory itself is already in the list from the earlier run
+            if (skip){
+                struct tar_t * dir = *slot;
+                *slot = dir -> next;
+                free(dir);
+                for(tar = slot; *tar; tar = &((*tar) -> next));
+                continue;
+            }
+
+            tar = &((*tar) -> next);
+        }
+        else{ // if (((*tar) -> type == REGULAR) || ((*tar) -> type == NORMAL) || ((*tar) -> type == CONTIGUOUS) || ((*tar) -> type == SYMLINK) || ((*tar) -> type == CHAR) || ((*tar) -> type == BLOCK) || ((*tar) -> type == FIFO)){
+            V_PRINT(stdout, "Writing %s", tar_entry_name(*tar));
+
+            char tarred = 0;   // whether or not the file has already been put into the archive
+            if (((*tar) -> type == REGULAR) || ((*tar) -> type == NORMAL) || ((*tar) -> type == CONTIGUOUS) || ((*tar) -> type == SYMLINK)){
+                struct tar_t * found = exists(*head, files[i], 1);
+                tarred = (found != (*tar));
+
+                // if file has already been included, modify the header
+                if (tarred){
+                    // change type to hard link
+                    (*tar) -> type = HARDLINK;
+
+                    // change link name to (*tar)red file name (both are the same)
+                    strncpy((*tar) -> link_name, tar_entry_name(*tar), 100);
+                    (*tar) -> long_link = (*tar) -> long_name;
+
+                    // change size to 0
+                    memset((*tar) -> size, '0', sizeof((*tar) -> size) - 1);
+
+                    // recalculate checksum
+                    calculate_checksum(*tar);
+                }
+            }
+
+            const char regular = ((*tar) -> type == REGULAR) || ((*tar) -> type == NORMAL) || ((*tar) -> type == CONTIGUOUS);
+            char padded = 0;   // whether the padding went into the archive with the data
+
+            // write metadata to (*tar) file
+            // a digest record is reserved in front of the entry and filled in once the data has been streamed
+            off_t digest_at;
+            const int extended = write_header(fd, *tar, *offset, regular && !tarred && (tar_opts.digest == DIGEST_CRC32C), &digest_at);
+            if (extended < 0){
+                ERROR("Failed to write metadata to archive");
+            }
+            *offset += extended;
+            (*tar) -> begin = *offset;
+            (*tar) -> extended = extended;
+            if (digest_at >= 0){
+                (*tar) -> digest = DIGEST_CRC32C;
+            }
+
+            if (regular){
+                // if the file isn't already in the tar file, copy the contents in
+                if (!tarred){
+                    unsigned int crc = 0;
+                    const struct uring_file * pre = prefetched_data(files[i]);
+
+                    // contents may already have been read through io_uring
+                    if (pre && (pre -> size == tar_get_size(*tar))){
+                        if (archive_write(fd, pre -> data, pre -> size) != pre -> size){
+                            RC_ERROR("Could not write to archive: %s", strerror(rc));
+                        }
+
+                        if (digest_at >= 0){
+                            crc = tar_crc32c(crc, pre -> data, pre -> size);
+                        }
+                    }
+                    else{
+                        int f = open_source(files[i]);
+                        if (f < 0){
+                            ERROR("Could not open %s", files[i]);
+                        }
+
+                        // small files are read straight in after their header, together with their padding
+                        const unsigned int size = tar_get_size(*tar);
+                        const unsigned int whole = (size + 511) & ~511u;
+                        char * gathered = (coalescing && (coalescing -> fd == fd) && !tar_opts.direct && (whole <= COALESCE_WRITE_MAX))?coalesce_reserve(whole):NULL;
+                        if (gathered){
+                            if (read_size(f, gathered, size) != size){
+                                coalescing -> used -= whole;
+                                close(f);
+                                ERROR("%s shrank while being archived", files[i]);
+                            }
+                            memset(gathered + size, 0, whole - size);
+                            padded = 1;
+
+                            if (digest_at >= 0){
+                                crc = tar_crc32c(crc, gathered, size);
+                            }
+                        }
+
+                        // whole chunks are always requested so O_DIRECT reads stay aligned
+                        unsigned int copied = gathered?size:0;
+                        while (copied < size){
+                            int r = read_size(f, source_buf, SOURCE_CHUNK);
+#ifdef O_DIRECT
+                            // file systems without O_DIRECT support reject the read; use the page cache instead
+                            if ((r <= 0) && (errno == EINVAL) && (fcntl(f, F_GETFL) & O_DIRECT)){
+                                fcntl(f, F_SETFL, fcntl(f, F_GETFL) & ~O_DIRECT);
+                                continue;
+                            }
+#endif
+                            if (r <= 0){
+                                close(f);
+                                ERROR("%s shrank while being archived", files[i]);
+                            }
+
+                            r = MIN(r, size - copied);
+                            if (archive_write(fd, source_buf, r) != r){
+                                RC_ERROR("Could not write to archive: %s", strerror(rc));
+                            }
+
+                            if (digest_at >= 0){
+                                crc = tar_crc32c(crc, source_buf, r);
+                            }
+                            copied += r;
+                        }
+
+#ifdef POSIX_FADV_DONTNEED
+                        if (tar_opts.low_impact){
+                            posix_fadvise(f, 0, 0, POSIX_FADV_DONTNEED);
+                        }
+#endif
+                        close(f);
+                    }
+
+                    // fill in the reserved digest
+                    if (digest_at >= 0){
+                        char hex[9];
+                        snprintf(hex, sizeof(hex), "%08x", crc);
+                        if (archive_pwrite(fd, hex, 8, digest_at) != 8){
+                            RC_ERROR("Could not write digest to archive: %s", strerror(rc));
+                        }
+                        (*tar) -> crc32c = crc;
+                    }
+                }
+            }
+
+            // pad data to fill block (small files gathered above already are)
+            const unsigned int size = tar_get_size(*tar);
+            const unsigned int pad = 512 - size % 512;
+            if (pad != 512){
+                // one write so the padding is a single operation under an IOPS limit
+                static const char zeros[512];
+                if (!padded && (archive_write(fd, zeros, pad) != pad)){
+                    ERROR("Could not write padding data");
+                }
+                *offset += pad;
+            }
+            *offset += size;
+            tar = &((*tar) -> next);
+
+            // add metadata size
+            *offset += 512;
+
+            release_archive(fd, *offset, 0);
+            checkpoint_save(fd, *offset, files[i]);
+        }
+    }
+
+    return 0;
+}
+
+// put a name into the name and prefix fields of a ustar header
+// returns 0 if they hold all of it
+static int split_name(struct tar_t * entry, const char * name, const size_t len){
+    if (len <= sizeof(entry -> name)){
+        memcpy(entry -> name, name, len);
+        return 0;
+    }
+
+    // split at a '/' so that the rest fits in name and everything before it in prefix
+    for(size_t i = len - sizeof(entry -> name) - 1; i < MIN(len, sizeof(entry -> prefix) + 1); i++){
+        if ((name[i] == '/') && i){
+            memcpy(entry -> prefix, name, i);
+            memcpy(entry -> name, name + i + 1, len - i - 1);
+            return 0;
+        }
+    }
+
+    // the full name goes into an extended header
+    memcpy(entry -> name, name, sizeof(entry -> name));
+    return -1;
+}
+
+// length of the leading "/", "./" or "../" left out of member names
+static int relative_skip(const char * filename){
+    if (!strncmp(filename, "/", 1)){
+        return 1;
+    }
+    else if (!strncmp(filename, "./", 2)){
+        return 2;
+    }
+    else if (!strncmp(filename, "../", 3)){
+        return 3;
+    }
+    return 0;
+}
+
+// replace an owner or group name with "NAME" or "NAME:ID"; without an ID, the id of a known name is used
+// returns -1 if the id is unknown and stays as it was
+static int override_id(char * name, const size_t size, const char * spec, const char user, unsigned long * id){
+    memset(name, 0, size);
+    const char * colon = strchr(spec, ':');
+    memcpy(name, spec, MIN(colon?(size_t) (colon - spec):strlen(spec), size - 1));
+
+    uid_t uid;
+    gid_t gid;
+    if (colon){
+        *id = strtoul(colon + 1, NULL, 10);
+    }
+    else if (user && !idcache_uid(name, &uid)){
+        *id = uid;
+    }
+    else if (!user && !idcache_gid(name, &gid)){
+        *id = gid;
+    }
+    else{
+        return -1;
+    }
+    return 0;
+}
+
+// apply --owner and --group
+static void override_owner(struct tar_t * entry){
+    unsigned long id;
+    if (tar_opts.owner && !override_id(entry -> owner, sizeof(entry -> owner), tar_opts.owner, 1, &id)){
+        tar_set_uid(entry, id);
+    }
+    if (tar_opts.group && !override_id(entry -> group, sizeof(entry -> group), tar_opts.group, 0, &id)){
+        tar_set_gid(entry, id);
+    }
+}
+
+int format_tar_data(struct tar_t * entry, const char * filename, char * long_name, const char verbosity){
+    if (!entry){
+        ERROR("Bad destination entry");
+    }
+
+    struct stat st;
+    if (prefetched_stat(filename, &st)){
+        RC_ERROR("Cannot stat %s: %s", filename, strerror(rc));
+    }
+
+    // remove relative path
+    const int move = relative_skip(filename);
+
+    // start putting in new data (all fields are NULL terminated ASCII strings)
+    memset(entry, 0, sizeof(struct tar_t));
+    entry -> original_name = filename;
+    memcpy(entry -> ustar, "ustar\00000", 8);
+
+    // directory names end in '/'
+    const char * name = filename + move;
+    size_t len = strlen(name);
+    const char slash = S_ISDIR(st.st_mode) && len && (name[len - 1] != '/');
+    if (len + slash >= sizeof(entry -> name)){
+        if (!long_name){
+            ERROR("Name too long: %s", name);
+        }
+
+        memcpy(long_name, name, len);
+        if (slash){
+            long_name[len++] = '/';
+        }
+        long_name[len] = '\0';
+        entry -> long_name = long_name;
+        split_name(entry, long_name, len);
+    }
+    else{
+        memcpy(entry -> name, name, len);
+        if (slash){
+            entry -> name[len] = '/';
+        }
+    }
+    tar_set_mode(entry, st.st_mode & 07777);
+    tar_set_uid(entry, st.st_uid);
+    tar_set_gid(entry, st.st_gid);
+    strncpy(entry -> owner, idcache_user(st.st_uid) ?: "", sizeof(entry -> owner) - 1);
+    strncpy(entry -> group, idcache_group(st.st_gid) ?: "", sizeof(entry -> group) - 1);
+    override_owner(entry);
+    tar_set_mtime(entry, st.st_mtime);
+    // sizes and offsets are kept in unsigned ints, although the size field itself holds up to 8 GiB
+    if (S_ISREG(st.st_mode) && ((unsigned long long) st.st_size > UINT_MAX)){
+        ERROR("File too large: %s", name);
+    }
+    tar_set_size(entry, S_ISREG(st.st_mode)?st.st_size:0);
+
+    // figure out filename type and fill in type-specific fields
+    switch (st.st_mode & S_IFMT) {
+        case S_IFREG:
+            entry -> type = NORMAL;
+            break;
+
+
+        case S_IFDIR:
+            entry -> type = DIRECTORY;
+            break;
+        case S_IFIFO:
+            entry -> type = FIFO;
+            break;
+
+        default:
+            entry -> type = -1;
+            ERROR("Error: Unknown filetype");
+    }
+
+    // get the checksum
+    calculate_checksum(entry);
+
+    return 0;
+}
+
+int write_end_data(const int fd, int size, const char verbosity){
     if (fd < 0){
+        return -1;
+    }
+
+    // complete current record
+    int pad = RECORDSIZE - (size % RECORDSIZE);
+
+    // if the current record does not have 2 blocks of zeros, add a whole other record
+    if (pad < (2 * BLOCKSIZE)){
+        pad += RECORDSIZE;
+    }
+
+    // all of it in one write
+    static const char zeros[2 * RECORDSIZE];
+    if (archive_write(fd, zeros, pad) != pad){
+        V_PRINT(stderr, "Error: Unable to close tar file");
+        return -1;
+    }
+
+    return pad;
+}
+
+
+unsigned int calculate_checksum(struct tar_t * entry){
+    // use spaces for the checksum bytes while calculating the checksum
+    memset(entry -> check, ' ', 8);
+
+    // sum of entire metadata
+    unsigned int check = 0;
+    for(int i = 0; i < 512; i++){
+        check += (unsigned char) entry -> block[i];
+    }
+
+    // six digits, a NUL and a space
+    tar_octal_encode(entry -> check, sizeof(entry -> check) - 2, check);
+    entry -> check[7] = ' ';
+    return check;
+}
+
+
+// apply the first --rename rule whose old name is name or a directory above it
+// returns name itself if no rule applies
+static const char * rename_entry(const char * name, char * buf){
+    for(int i = 0; i < tar_opts.rename_count; i++){
+        const char * rule = tar_opts.rename[i];
+        const char * to = strchr(rule, '=');
+        if (!to){
+            continue;
+        }
+
+        size_t len = to++ - rule;
+        while (len && (rule[len - 1] == '/')){
+            len--;
+        }
+
+        if (len && !strncmp(name, rule, len) && (!name[len] || (name[len] == '/'))){
+            // renaming to nothing strips the directory
+            const char * rest = name + len + (!*to && name[len]);
+            snprintf(buf, TAR_PATH_MAX, "%s%s", to, rest);
+            return buf;
+        }
+    }
+    return name;
+}
+
+struct transform_state {
+    int out;
+    int offset;                             // bytes written to out
+    char seekable;
+    char verbosity;
+};
+
+static int transform_visit(const int fd, struct tar_t * entry, void * arg){
+    struct transform_state * state = arg;
+    const char verbosity = state -> verbosity;
+    const unsigned int size = tar_get_size(entry);
+    const int consumed = state -> seekable?0:size;
+
+    // entries renamed to nothing are dropped
+    char name[TAR_PATH_MAX];
+    const char * renamed = rename_entry(tar_entry_name(entry), name);
+    if (!*renamed){
+        return 0;
+    }
+    if (renamed != name){
+        snprintf(name, sizeof(name), "%s", renamed);
+    }
+
+    // the header is rewritten as ustar, with extended headers for whatever does not fit
+    memset(entry -> name, 0, sizeof(entry -> name));
+    memset(entry -> prefix, 0, sizeof(entry -> prefix));
+    memcpy(entry -> ustar, "ustar\00000", 8);
+    entry -> long_name = name;
+    split_name(entry, name, strlen(name));
+
+    // hard links point at other members, which were renamed the same way
+    char link[TAR_PATH_MAX];
+    if (entry -> type == HARDLINK){
+        const char * target = rename_entry(tar_entry_link(entry), link);
+        if (target != link){
+            snprintf(link, sizeof(link), "%s", target);
+        }
+        memset(entry -> link_name, 0, sizeof(entry -> link_name));
+        memcpy(entry -> link_name, link, MIN(strlen(link), sizeof(entry -> link_name)));
+        entry -> long_link = link;
+    }
+
+    override_owner(entry);
+    calculate_checksum(entry);
+
+    off_t digest_at;
+    const int extended = write_header(state -> out, entry, state -> offset, entry -> digest == DIGEST_CRC32C, &digest_at);
+    if (extended < 0){
+        RC_ERROR("Unable to write header of %s: %s", name, strerror(rc));
+    }
+    state -> offset += extended + 512;
+
+    // data is passed through untouched
+    if (size){
+        if (stream_data(state -> out, fd, state -> seekable?(off_t) entry -> begin + 512:-1, size) < 0){
+            RC_ERROR("Unable to copy %s: %s", name, strerror(rc));
+        }
+
+        static const char zeros[512];
+        const unsigned int pad = (size % 512)?(512 - (size % 512)):0;
+        if (write_size(state -> out, (char *) zeros, pad) != pad){
+            RC_ERROR("Unable to write padding of %s: %s", name, strerror(rc));
+        }
+        state -> offset += size + pad;
+    }
+    stats_add(STAT_ENTRIES, 1);
+    V_PRINT(stderr, "%s", name);
+
+    return consumed;
+}
+
+int tar_transform(const int in, const int out, int filecount, const char * files[], const char verbosity){
+    STATS_PHASE(PHASE_WRITE);
+
+    if ((in < 0) || (out < 0)){
         ERROR("Bad file descriptor");
     }
 
-    if (!archive || *archive){
-        ERROR("Bad archive");
+    struct transform_state state = { .out = out, .verbosity = verbosity };
+    state.seekable = stats_lseek(in, 0, SEEK_CUR) != (off_t) (-1);
+
+    int ret = tar_walk(in, filecount, files, transform_visit, &state, verbosity);
+
+    if (write_end_data(out, state.offset, verbosity) < 0){
+        ERROR("Failed to write end data");
+    }
+
+    return ret;
+}
+
+// a file or directory going into a sharded archive
+struct shard_member {
+    char * path;
+    unsigned long long weight;              // bytes it takes up in an archive
+    int shard;
+    char dir;
+};
+
+struct shard_list {
+    struct shard_member * members;
+    int count, space;
+};
+
+// list path and, for directories, everything below it that is not excluded
+static int shard_collect(struct shard_list * list, const char * path, const struct matcher * m){
+    struct stat st;
+    if (stats_stat(path, &st)){
+        RC_ERROR("Cannot stat %s: %s", path, strerror(rc));
+    }
+
+    if (list -> count == list -> space){
+        list -> space = list -> space?(2 * list -> space):256;
+        list -> members = realloc(list -> members, list -> space * sizeof(struct shard_member));
+    }
+
+    struct shard_member * member = &list -> members[list -> count++];
+    member -> path = strdup(path);
+    member -> dir = S_ISDIR(st.st_mode);
+    member -> weight = 512 + (member -> dir?0:((st.st_size + 511) & ~511ull));
+    member -> shard = 0;
+    if (!member -> dir){
+        return 0;
+    }
+
+    DIR * d = opendir(path);
+    if (!d){
+        ERROR("Cannot open directory %s", path);
+    }
+
+    size_t len = strlen(path);
+    while ((len > 1) && (path[len - 1] == '/')){
+        len--;
+    }
+
+    int ret = 0;
+    struct dirent * dir;
+    while (!ret && (dir = readdir(d))){
+        if (!strcmp(dir -> d_name, ".") || !strcmp(dir -> d_name, "..")){
+            continue;
+        }
+
+        char * child = calloc(len + strlen(dir -> d_name) + 2, sizeof(char));
+        sprintf(child, "%.*s/%s", (int) len, path, dir -> d_name);
+        if (!m -> excludes || (matcher_match(m, child, NULL) > 0)){
+            ret = shard_collect(list, child, m);
+        }
+        free(child);
+    }
+    closedir(d);
+
+    return ret;
+}
+
+struct shard_write {
+    char * path;
+    const char ** files;
+    int count;
+    int ret;
+    char verbosity;
+};
+
+static void * shard_writer(void * arg){
+    struct shard_write * job = arg;
+    const char verbosity = job -> verbosity;
+
+    job -> ret = -1;
+    const int fd = open(job -> path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        V_PRINT(stderr, "Error: Unable to create %s: %s", job -> path, strerror(errno));
+        return NULL;
+    }
+
+    // directories were listed along with their contents
+    shallow = 1;
+    struct tar_t * archive = NULL;
+    job -> ret = (tar_write(fd, &archive, job -> count, job -> files, verbosity) < 0)?-1:0;
+    shallow = 0;
+
+    tar_free(archive);
+    close(fd);
+
+    return NULL;
+}
+
+static int compare_weight(const void * a, const void * b){
+    const unsigned long long x = (*(struct shard_member * const *) a) -> weight;
+    const unsigned long long y = (*(struct shard_member * const *) b) -> weight;
+    return (x < y) - (x > y);
+}
+
+int tar_write_shards(const char * base, int shards, int filecount, const char * files[], const char verbosity){
+    STATS_PHASE(PHASE_WRITE);
+
+    if (!base){
+        ERROR("Bad archive name");
     }
 
     if (filecount && !files){
         ERROR("Non-zero file count provided, but file list is NULL");
     }
 
-    // add new data
-    struct tar_t ** tar = archive;  // current entry
-    for(unsigned int i = 0; i < filecount; i++){
-        *tar = malloc(sizeof(struct tar_t));
+    if (shards < 1){
+        shards = 1;
+    }
 
-        // stat file
-        if (format_tar_data(*tar, files[i], verbosity) < 0){
-            ERROR("Failed to stat %s", files[i]);
+    struct matcher m;
+    if (tar_matcher(&m, 0, NULL) < 0){
+        ERROR("Unable to compile excluded patterns");
+    }
+
+    struct shard_list list = { NULL, 0, 0 };
+    int ret = 0;
+    for(int i = 0; !ret && (i < filecount); i++){
+        if (!m.excludes || (matcher_match(&m, files[i], NULL) > 0)){
+            ret = shard_collect(&list, files[i], &m);
+        }
+    }
+    matcher_free(&m);
+
+    // largest files first, each to the emptiest shard
+    // directories all go to the first shard, ahead of any file, so it can restore their metadata
+    unsigned long long * load = calloc(shards, sizeof(unsigned long long));
+    struct shard_member ** order = calloc(list.count + 1, sizeof(struct shard_member *));
+    int files_count = 0;
+    for(int i = 0; i < list.count; i++){
+        if (list.members[i].dir){
+            load[0] += list.members[i].weight;
+        }
+        else{
+            order[files_count++] = &list.members[i];
+        }
+    }
+    qsort(order, files_count, sizeof(struct shard_member *), compare_weight);
+
+    for(int i = 0; i < files_count; i++){
+        int lightest = 0;
+        for(int s = 1; s < shards; s++){
+            if (load[s] < load[lightest]){
+                lightest = s;
+            }
+        }
+        order[i] -> shard = lightest;
+        load[lightest] += order[i] -> weight;
+    }
+    free(order);
+    free(load);
+
+    // each shard keeps the order files were found in
+    struct shard_write * jobs = calloc(shards, sizeof(struct shard_write));
+    const size_t baselen = strlen(base);
+    for(int s = 0; s < shards; s++){
+        jobs[s].path = calloc(baselen + 16, sizeof(char));
+        sprintf(jobs[s].path, "%s.%d", base, s);
+        jobs[s].files = calloc(list.count + 1, sizeof(char *));
+        jobs[s].verbosity = verbosity;
+    }
+    for(int dirs = 1; dirs >= 0; dirs--){
+        for(int i = 0; i < list.count; i++){
+            if (list.members[i].dir == dirs){
+                struct shard_write * job = &jobs[list.members[i].shard];
+                job -> files[job -> count++] = list.members[i].path;
+            }
+        }
+    }
+
+    pthread_t * workers = calloc(shards, sizeof(pthread_t));
+    char * started = calloc(shards, sizeof(char));
+    for(int s = 0; !ret && (s < shards); s++){
+        started[s] = !pthread_create(&workers[s], NULL, shard_writer, &jobs[s]);
+        if (!started[s]){
+            shard_writer(&jobs[s]);
+        }
+    }
+    for(int s = 0; s < shards; s++){
+        if (started[s]){
+            pthread_join(workers[s], NULL);
+        }
+        ret |= jobs[s].ret;
+    }
+    free(started);
+    free(workers);
+
+    // manifest: shard count, then the shard and name of every member
+    if (!ret){
+        char * path = calloc(baselen + 16, sizeof(char));
+        sprintf(path, "%s.manifest", base);
+        FILE * f = fopen(path, "w");
+        if (f){
+            fprintf(f, "shards %d\n", shards);
+            for(int i = 0; i < list.count; i++){
+                const char * name = list.members[i].path + relative_skip(list.members[i].path);
+                const size_t len = strlen(name);
+                fprintf(f, "%d %s%s\n", list.members[i].shard, name, (list.members[i].dir && len && (name[len - 1] != '/'))?"/":"");
+            }
+            ret = fclose(f)?-1:0;
+        }
+        if (!f || ret){
+            fprintf(stderr, "Error: Unable to write %s\n", path);
+            ret = -1;
+        }
+        free(path);
+    }
+
+    for(int s = 0; s < shards; s++){
+        free(jobs[s].path);
+        free(jobs[s].files);
+    }
+    free(jobs);
+    for(int i = 0; i < list.count; i++){
+        free(list.members[i].path);
+    }
+    free(list.members);
+
+    return ret;
+}
+
+struct shard_read {
+    char * path;
+    const struct matcher * m;               // NULL to extract everything
+    struct extract_state state;
+    int ret;
+};
+
+static int shard_visit(const int fd, struct tar_t * entry, void * arg){
+    struct shard_read * job = arg;
+    if (job -> m && (matcher_match(job -> m, tar_entry_name(entry), NULL) < 0)){
+        return 0;
+    }
+    return extract_visit(fd, entry, &job -> state);
+}
+
+static void * shard_reader(void * arg){
+    struct shard_read * job = arg;
+    const char verbosity = job -> state.verbosity;
+
+    const int fd = open(job -> path, O_RDONLY);
+    if (fd < 0){
+        V_PRINT(stderr, "Error: Unable to open %s: %s", job -> path, strerror(errno));
+        job -> ret = -1;
+        return NULL;
+    }
+
+    job -> ret = tar_walk(fd, 0, NULL, shard_visit, job, verbosity);
+    close(fd);
+
+    return NULL;
+}
+
+int tar_extract_shards(const char * base, int filecount, const char * files[], const char verbosity){
+    STATS_PHASE(PHASE_EXTRACT);
+
+    if (!base){
+        ERROR("Bad archive name");
+    }
+
+    if (filecount && !files){
+        ERROR("Non-zero file count provided, but file list is NULL");
+    }
+
+    const size_t baselen = strlen(base);
+    char * path = calloc(baselen + 16, sizeof(char));
+    sprintf(path, "%s.manifest", base);
+    FILE * f = fopen(path, "r");
+    free(path);
+    int shards = 0;
+    if (!f || (fscanf(f, "shards %d\n", &shards) != 1) || (shards < 1)){
+        if (f){
+            fclose(f);
+        }
+        ERROR("Unable to read manifest of %s", base);
+    }
+
+    struct matcher m;
+    if (tar_matcher(&m, filecount, files) < 0){
+        fclose(f);
+        ERROR("Unable to compile file list");
+    }
+    const char select = filecount || m.excludes;
+
+    // the manifest tells which shards hold anything selected
+    char * needed = calloc(shards, sizeof(char));
+    char * seen = calloc(filecount + 1, sizeof(char));
+    char line[TAR_PATH_MAX + 32];
+    while (fgets(line, sizeof(line), f)){
+        line[strcspn(line, "\n")] = '\0';
+        char * name;
+        const int shard = strtol(line, &name, 10);
+        if ((shard >= 0) && (shard < shards) && (*name == ' ')){
+            needed[shard] |= !select || (matcher_match(&m, name + 1, seen) > 0);
+        }
+    }
+    fclose(f);
+
+    int ret = 0;
+    for(int i = 0; i < filecount; i++){
+        if (!seen[i]){
+            fprintf(stderr, "Error: '%s' not found in archive\n", files[i]);
+            ret = -1;
+        }
+    }
+    free(seen);
+
+    // each shard is extracted on its own thread with its own directory cache
+    struct shard_read * jobs = calloc(shards, sizeof(struct shard_read));
+    pthread_t * workers = calloc(shards, sizeof(pthread_t));
+    char * started = calloc(shards, sizeof(char));
+    for(int s = 0; s < shards; s++){
+        if (!needed[s]){
+            continue;
+        }
+
+        jobs[s].path = calloc(baselen + 16, sizeof(char));
+        sprintf(jobs[s].path, "%s.%d", base, s);
+        jobs[s].m = select?&m:NULL;
+        jobs[s].state.seekable = 1;
+        jobs[s].state.verbosity = verbosity;
+        if (extract_ctx_init(&jobs[s].state.ctx) < 0){
+            ret = -1;
+            needed[s] = 0;
+        }
+    }
+
+    // contexts are all set up before any shard starts creating files
+    for(int s = 0; s < shards; s++){
+        if (!needed[s]){
+            continue;
+        }
+
+        started[s] = !pthread_create(&workers[s], NULL, shard_reader, &jobs[s]);
+        if (!started[s]){
+            shard_reader(&jobs[s]);
+        }
+    }
+
+    // directory metadata is applied once every shard has written into the directories
+    for(int s = 0; s < shards; s++){
+        if (started[s]){
+            pthread_join(workers[s], NULL);
+        }
+    }
+    for(int s = 0; s < shards; s++){
+        if (needed[s]){
+            extract_ctx_finish(&jobs[s].state.ctx);
+            extract_ctx_free(&jobs[s].state.ctx);
+            ret |= jobs[s].ret;
+        }
+        free(jobs[s].path);
+    }
+    free(started);
+    free(workers);
+    free(jobs);
+    free(needed);
+    matcher_free(&m);
+
+    return ret;
+}
+
+int tar_update(const int fd, struct tar_t ** archive, const size_t filecount, const char * files[], const char verbosity){
+    if (!filecount){
+        return 0;
+    }
+
+    if (filecount && !files){
+        ERROR("Non-zero file count provided, but file list is NULL");
+    }
+
+    // buffer for subset of files that need to be updated
+    char ** newer = calloc(filecount, sizeof(char *));
+
+    struct stat st;
+    int count = 0;
+    int all = 1;
+
+    // check each source to see if it was updated
+    struct tar_t * tar = *archive;
+    for(int i = 0; i < filecount; i++){
+        // make sure original file exists
+        if (stats_stat(files[i], &st)){
+            all = 0;
+            RC_ERROR("Could not stat %s: %s", files[i], strerror(rc));
+        }
+
+        // find the file in the archive
+        struct tar_t * old = exists(tar, files[i], 1);
+        newer[count] = calloc(strlen(files[i]) + 1, sizeof(char));
+
+        // if there is an older version, check its timestamp
+        if (old){
+            if (st.st_mtime > tar_get_mtime(old)){
+                strncpy(newer[count++], files[i], strlen(files[i]));
+                V_PRINT(stdout, "%s", files[i]);
+            }
+        }
+        // if there is no older version, just add it
+        else{
+            strncpy(newer[count++], files[i], strlen(files[i]));
+            V_PRINT(stdout, "%s", files[i]);
+        }
+    }
+
+    // update listed files only
+    if (tar_write(fd, archive, count, (const char **) newer, verbosity) < 0){
+        ERROR("Unable to update archive");
+    }
+
+    // cleanup
+    for(int i = 0; i < count; i++){
+        free(newer[i]);
+    }
+    free(newer);
+
+    return all?0:-1;
+}
+
+
+int tar_open(struct tar_archive * archive, const char * path, const char verbosity){
+    if (!archive || !path){
+        ERROR("Bad archive");
+    }
+
+    memset(archive, 0, sizeof(struct tar_archive));
+    archive -> fd = open(path, O_RDONLY);
+    if (archive -> fd < 0){
+        RC_ERROR("Unable to open %s: %s", path, strerror(rc));
+    }
+
+    const int count = tar_read(archive -> fd, &archive -> entries, verbosity);
+    if (count < 0){
+        tar_close(archive);
+        ERROR("Unable to read %s", path);
+    }
+    archive -> count = count;
+
+    // keep the table at most half full
+    archive -> buckets = 16;
+    while (archive -> buckets < 2 * (unsigned int) count){
+        archive -> buckets <<= 1;
+    }
+    archive -> index = calloc(archive -> buckets, sizeof(struct tar_t *));
+
+    // later entries replace earlier ones with the same name
+    for(struct tar_t * entry = archive -> entries; entry; entry = entry -> next){
+        const char * name = tar_entry_name(entry);
+        unsigned int i = name_hash(name, strlen(name)) & (archive -> buckets - 1);
+        while (archive -> index[i] && strcmp(tar_entry_name(archive -> index[i]), name)){
+            i = (i + 1) & (archive -> buckets - 1);
+        }
+        archive -> index[i] = entry;
+    }
+
+    return 0;
+}
+
+struct tar_t * tar_lookup(const struct tar_archive * archive, const char * name){
+    if (!archive || !archive -> index || !name){
+        return NULL;
+    }
+
+    const size_t len = strlen(name);
+    unsigned int i = name_hash(name, len) & (archive -> buckets - 1);
+    while (archive -> index[i]){
+        struct tar_t * entry = archive -> index[i];
+        if (!strcmp(tar_entry_name(entry), name)){
+            return entry;
+        }
+        i = (i + 1) & (archive -> buckets - 1);
+    }
+
+    return NULL;
+}
+
+int tar_reader_open(struct tar_reader * reader, const struct tar_archive * archive, const char * name){
+    if (!reader){
+        ERROR("Bad reader");
+    }
+
+    const struct tar_t * entry = tar_lookup(archive, name);
+    if (!entry){
+        ERROR("'%s' not found in archive", name);
+    }
+
+    // hard links have no data of their own
+    const struct tar_t * data = entry;
+    if (data -> type == HARDLINK){
+        const char * target = tar_entry_link(data);
+        if (!(data = tar_lookup(archive, target))){
+            ERROR("Link target '%s' not found in archive", target);
+        }
+    }
+
+    if ((data -> type != REGULAR) && (data -> type != NORMAL) && (data -> type != CONTIGUOUS)){
+        ERROR("'%s' is not a regular file", name);
+    }
+
+    reader -> archive = archive;
+    reader -> entry = entry;
+    reader -> data = (off_t) data -> begin + 512;
+    reader -> size = tar_get_size(data);
+    reader -> pos = 0;
+    return 0;
+}
+
+ssize_t tar_reader_pread(const struct tar_reader * reader, char * buf, size_t size, off_t offset){
+    if (!reader || (offset < 0)){
+        return -1;
+    }
+
+    // never read past the end of the member
+    if (offset >= reader -> size){
+        return 0;
+    }
+    if (size > reader -> size - offset){
+        size = reader -> size - offset;
+    }
+
+    size_t got = 0;
+    while (got < size){
+        const ssize_t rd = pread(reader -> archive -> fd, buf + got, size - got, reader -> data + offset + got);
+        stats_add(STAT_READS, 1);
+        if (rd < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        if (!rd){
+            break;
         }
+        got += rd;
+    }
+
+    stats_add(STAT_BYTES_READ, got);
+    return got;
+}
+
+ssize_t tar_reader_read(struct tar_reader * reader, char * buf, size_t size){
+    const ssize_t got = tar_reader_pread(reader, buf, size, reader?reader -> pos:0);
+    if (got > 0){
+        reader -> pos += got;
+    }
+    return got;
+}
 
-        (*tar) -> begin = *offset;
+void tar_close(struct tar_archive * archive){
+    if (!archive){
+        return;
+    }
 
-        // directories need special handling
-        if ((*tar) -> type == DIRECTORY){
-            // save parent directory name (source will change)
-            const size_t len = strlen((*tar) -> name);
-            char * parent = calloc(len + 1, sizeof(char));
-            strncpy(parent, (*tar) -> name, len);
+    if (archive -> fd >= 0){
+        close(archive -> fd);
+    }
+    tar_free(archive -> entries);
+    free(archive -> index);
+    memset(archive, 0, sizeof(struct tar_archive));
+    archive -> fd = -1;
+}
 
-            // add a '/' character to the end
-            if ((len < 99) && ((*tar) -> name[len - 1] != '/')){
-                (*tar) -> name[len] = '/';
-                (*tar) -> name[len + 1] = '\0';
-                calculate_checksum(*tar);
-            }
+void tar_buffer_init(struct tar_buffer * buf, char * data, const size_t capacity){
+    buf -> data = data;
+    buf -> size = 0;
+    buf -> capacity = data?capacity:0;
+    buf -> fixed = !!data;
+}
 
-            V_PRINT(stdout, "Writing %s", (*tar) -> name);
+void tar_buffer_reset(struct tar_buffer * buf){
+    buf -> size = 0;
+}
 
-            // write metadata to (*tar) file
-            if (write_size(fd, (*tar) -> block, 512) != 512){
-                ERROR("Failed to write metadata to archive");
-            }
+void tar_buffer_free(struct tar_buffer * buf){
+    if (!buf -> fixed){
+        free(buf -> data);
+    }
+    tar_buffer_init(buf, NULL, 0);
+}
 
-            // go through directory
-            DIR * d = opendir(parent);
-            if (!d){
-                ERROR("Cannot open directory %s", parent);
-            }
+// make room for size more bytes; memory is only ever grown, so a reused buffer stops allocating
+static char * tar_buffer_reserve(struct tar_buffer * buf, const size_t size){
+    if (buf -> size + size > buf -> capacity){
+        if (buf -> fixed){
+            errno = ENOSPC;
+            return NULL;
+        }
 
-            struct dirent * dir;
-            while ((dir = readdir(d))){
-                // if not special directories . and ..
-                const size_t sublen = strlen(dir -> d_name);
-                if (strncmp(dir -> d_name, ".", sublen) && strncmp(dir -> d_name, "..", sublen)){
-                    char * path = calloc(len + sublen + 2, sizeof(char));
-                    sprintf(path, "%s/%s", parent, dir -> d_name);
+        size_t capacity = buf -> capacity?buf -> capacity:RECORDSIZE;
+        while (capacity < buf -> size + size){
+            capacity *= 2;
+        }
 
-                    // recursively write each subdirectory
-                    if (write_entries(fd, &((*tar) -> next), head, 1, (const char **) &path, offset, verbosity) < 0){
-                        ERROR("Recurse error");
-                    }
+        char * data = realloc(buf -> data, capacity);
+        if (!data){
+            return NULL;
+        }
+        buf -> data = data;
+        buf -> capacity = capacity;
+    }
+    return buf -> data + buf -> size;
+}
 
-                    // go to end of new data
-                    while ((*tar) -> next){
-                        tar = &((*tar) -> next);
-                    }
+int tar_buffer_add(struct tar_buffer * buf, const char * name, const void * data, const size_t size, const unsigned int mode, const time_t mtime){
+    const size_t len = name?strlen(name):0;
+    if (!len || (len >= TAR_PATH_MAX)){
+        errno = EINVAL;
+        return -1;
+    }
 
-                    free(path);
-                }
-            }
-            closedir(d);
+    // names ending in '/' are directories
+    const char dir = name[len - 1] == '/';
+    const size_t data_size = dir?0:size;
+    const size_t data_padded = (data_size + 511) & ~(size_t) 511;
 
-            free(parent);
+    struct tar_t entry;
+    memset(&entry, 0, sizeof(struct tar_t));
+    if (tar_set_size(&entry, data_size)){
+        errno = EFBIG;
+        return -1;
+    }
+    memcpy(entry.ustar, "ustar\00000", 8);
+    const char pax = split_name(&entry, name, len) < 0;
+    tar_set_mode(&entry, mode & 07777);
+    tar_set_uid(&entry, 0);
+    tar_set_gid(&entry, 0);
+    tar_set_mtime(&entry, mtime);
+    entry.type = dir?DIRECTORY:NORMAL;
+    calculate_checksum(&entry);
+
+    // a name that does not fit goes into a PAX header in front (the record is at most len + 16 bytes)
+    const size_t records_padded = pax?((len + 16 + 511) & ~(size_t) 511):0;
+    char * at = tar_buffer_reserve(buf, (pax?512 + records_padded:0) + 512 + data_padded);
+    if (!at){
+        return -1;
+    }
 
-            tar = &((*tar) -> next);
-        }
-        else{ // if (((*tar) -> type == REGULAR) || ((*tar) -> type == NORMAL) || ((*tar) -> type == CONTIGUOUS) || ((*tar) -> type == SYMLINK) || ((*tar) -> type == CHAR) || ((*tar) -> type == BLOCK) || ((*tar) -> type == FIFO)){
-            V_PRINT(stdout, "Writing %s", (*tar) -> name);
+    if (pax){
+        const int used = pax_record(at + 512, records_padded, "path", name);
+        struct tar_t header;
+        format_pax_header(&header, &entry, used);
+        memcpy(at, header.block, 512);
+        memset(at + 512 + used, 0, records_padded - used);
+        at += 512 + records_padded;
+    }
 
-            char tarred = 0;   // whether or not the file has already been put into the archive
-            if (((*tar) -> type == REGULAR) || ((*tar) -> type == NORMAL) || ((*tar) -> type == CONTIGUOUS) || ((*tar) -> type == SYMLINK)){
-                struct tar_t * found = exists(*head, files[i], 1);
-                tarred = (found != (*tar));
+    memcpy(at, entry.block, 512);
+    if (data_size){
+        memcpy(at + 512, data, data_size);
+    }
+    memset(at + 512 + data_size, 0, data_padded - data_size);
 
-                // if file has already been included, modify the header
-                if (tarred){
-                    // change type to hard link
-                    (*tar) -> type = HARDLINK;
+    buf -> size = at + 512 + data_padded - buf -> data;
+    return 0;
+}
 
-                    // change link name to (*tar)red file name (both are the same)
-                    strncpy((*tar) -> link_name, (*tar) -> name, 100);
+int tar_buffer_finish(struct tar_buffer * buf){
+    // the same end of archive write_end_data produces
+    size_t pad = RECORDSIZE - (buf -> size % RECORDSIZE);
+    if (pad < (2 * BLOCKSIZE)){
+        pad += RECORDSIZE;
+    }
 
-                    // change size to 0
-                    memset((*tar) -> size, '0', sizeof((*tar) -> size) - 1);
+    char * at = tar_buffer_reserve(buf, pad);
+    if (!at){
+        return -1;
+    }
+    memset(at, 0, pad);
+    buf -> size += pad;
 
-                    // recalculate checksum
-                    calculate_checksum(*tar);
-                }
-            }
+    return 0;
+}
 
-            // write metadata to (*tar) file
-            if (write_size(fd, (*tar) -> block, 512) != 512){
-                ("Failed to write metadata to archive");
-            }
+void tar_mem_iter_init(struct tar_mem_iter * iter, const void * data, const size_t size){
+    iter -> data = data;
+    iter -> size = size;
+    iter -> pos = 0;
+}
 
-            if (((*tar) -> type == REGULAR) || ((*tar) -> type == NORMAL) || ((*tar) -> type == CONTIGUOUS)){
-                // if the file isn't already in the tar file, copy the contents in
-                if (!tarred){
-                    int f = open((*tar) -> name, O_RDONLY);
-                    if (f < 0){
-                        ERROR("Could not open %s", files[i]);
-                    }
+int tar_mem_next(struct tar_mem_iter * iter, struct tar_mem_member * member){
+    struct tar_t * entry = &iter -> entry;
+    memset(entry, 0, sizeof(struct tar_t));
 
-                    int r = 0;
-                    char buf[512];
-                    while ((r = read_size(f, buf, 512)) > 0){
-                        if (write_size(fd, buf, r) != r){
-                            RC_ERROR("Could not write to archive: %s", strerror(rc));
-                        }
+    while (1){
+        // an archive may end without its end of archive blocks
+        if (iter -> pos + 512 > iter -> size){
+            return (iter -> pos == iter -> size)?0:-1;
+        }
 
-                    }
+        const char * block = iter -> data + iter -> pos;
+        if (iszeroed((char *) block, 512)){
+            iter -> pos = iter -> size;
+            return 0;
+        }
 
-                    close(f);
-                }
-            }
+        // long names found so far are kept for the header they belong to
+        memcpy(entry -> block, block, 512);
+        if (!header_valid(entry)){
+            return -1;
+        }
 
-            // pad data to fill block
-            const unsigned int size = oct2uint((*tar) -> size, 11);
-            const unsigned int pad = 512 - size % 512;
-            if (pad != 512){
-                for(unsigned int j = 0; j < pad; j++){
-                    if (write_size(fd, "\0", 1) != 1){
-                        ERROR("Could not write padding data");
-                    }
-                }
-                *offset += pad;
-            }
-            *offset += size;
-            tar = &((*tar) -> next);
+        const size_t size = tar_get_size(entry);
+        const size_t padded = (size + 511) & ~(size_t) 511;
+        if (iter -> pos + 512 + padded > iter -> size){
+            return -1;
         }
+        const char * data = block + 512;
+        iter -> pos += 512 + padded;
 
-        // add metadata size
-        *offset += 512;
+        if (entry -> type == PAX_HEADER){
+            pax_parse(entry, data, size, &iter -> names);
+        }
+        else if (entry -> type == GNU_LONGNAME){
+            entry -> long_name = long_copy(iter -> names.name, data, strnlen(data, size));
+        }
+        else if (entry -> type == GNU_LONGLINK){
+            entry -> long_link = long_copy(iter -> names.link, data, strnlen(data, size));
+        }
+        else if (entry -> type != PAX_GLOBAL){
+            complete_names(entry, &iter -> names);
+
+            member -> name = tar_entry_name(entry);
+            member -> link = tar_entry_link(entry);
+            member -> data = data;
+            member -> size = size;
+            member -> mode = tar_get_mode(entry);
+            member -> mtime = tar_get_mtime(entry);
+            member -> type = entry -> type;
+            return 1;
+        }
     }
+}
 
-    return 0;
+// archive kept open by the server, with the file state its index was built from
+struct served_archive {
+    char * path;
+    struct tar_archive archive;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    int users;                              // requests using it right now
+    char stale;                             // replaced; closed by its last user
+    struct served_archive * next;
+};
+
+static pthread_mutex_t served_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct served_archive * served;
+
+static void served_free(struct served_archive * s){
+    tar_close(&s -> archive);
+    free(s -> path);
+    free(s);
 }
 
-int format_tar_data(struct tar_t * entry, const char * filename, const char verbosity){
-    if (!entry){
-        ERROR("Bad destination entry");
+// take *link out of the cache; it is closed now or when its last request is done
+// served_lock must be held
+static void served_drop(struct served_archive ** link){
+    struct served_archive * s = *link;
+    *link = s -> next;
+    s -> stale = 1;
+    if (!s -> users){
+        served_free(s);
     }
+}
 
+// index of the archive at path, scanned again if the file changed since it was indexed
+static struct served_archive * served_get(const char * path, const char verbosity){
     struct stat st;
-    if (stat(filename, &st)){
-        RC_ERROR("Cannot stat %s: %s", filename, strerror(rc));
+    if (stat(path, &st) < 0){
+        return NULL;
     }
 
-    // remove relative path
-    int move = 0;
-    if (!strncmp(filename, "/", 1)){
-        move = 1;
+    pthread_mutex_lock(&served_lock);
+    for(struct served_archive ** link = &served; *link; link = &(*link) -> next){
+        struct served_archive * s = *link;
+        if (strcmp(s -> path, path)){
+            continue;
+        }
+
+        if ((s -> dev == st.st_dev) && (s -> ino == st.st_ino) && (s -> size == st.st_size) &&
+            (s -> mtime.tv_sec == st.st_mtim.tv_sec) && (s -> mtime.tv_nsec == st.st_mtim.tv_nsec)){
+            s -> users++;
+            pthread_mutex_unlock(&served_lock);
+            return s;
+        }
+
+        V_PRINT(stderr, "%s changed, reading it again", path);
+        served_drop(link);
+        break;
     }
-    else if (!strncmp(filename, "./", 2)){
-        move = 2;
+    pthread_mutex_unlock(&served_lock);
+
+    // scanning can take a while, so other requests go on meanwhile
+    struct served_archive * s = calloc(1, sizeof(struct served_archive));
+    if (!s || !(s -> path = strdup(path)) || (tar_open(&s -> archive, path, 0) < 0)){
+        if (s){
+            free(s -> path);
+            free(s);
+        }
+        return NULL;
     }
-    else if (!strncmp(filename, "../", 3)){
-        move = 3;
+
+    // the key describes the file that was indexed, even if path was replaced since the stat above
+    if (fstat(s -> archive.fd, &st) < 0){
+        tar_close(&s -> archive);
+        free(s -> path);
+        free(s);
+        return NULL;
     }
+    s -> dev = st.st_dev;
+    s -> ino = st.st_ino;
+    s -> size = st.st_size;
+    s -> mtime = st.st_mtim;
+    s -> users = 1;
+
+    // another request may have indexed the same archive at the same time
+    pthread_mutex_lock(&served_lock);
+    for(struct served_archive ** link = &served; *link; link = &(*link) -> next){
+        if (!strcmp((*link) -> path, path)){
+            served_drop(link);
+            break;
+        }
+    }
+    s -> next = served;
+    served = s;
+    pthread_mutex_unlock(&served_lock);
 
-    // start putting in new data (all fields are NULL terminated ASCII strings)
-    memset(entry, 0, sizeof(struct tar_t));
-    strncpy(entry -> original_name, filename, 100);
-    strncpy(entry -> name, filename + move, 100);
-    snprintf(entry -> mode,  sizeof(entry -> mode),  "%07o", st.st_mode & 0777);
-    snprintf(entry -> uid,   sizeof(entry -> uid),   "%07o", st.st_uid);
-    snprintf(entry -> gid,   sizeof(entry -> gid),   "%07o", st.st_gid);
-    snprintf(entry -> size,  sizeof(entry -> size),  "%011o", (int) st.st_size);
-    snprintf(entry -> mtime, sizeof(entry -> mtime), "%011o", (int) st.st_mtime);
+    return s;
+}
 
-    // figure out filename type and fill in type-specific fields
-    switch (st.st_mode & S_IFMT) {
-        case S_IFREG:
-            entry -> type = NORMAL;
-            break;
+static void served_put(struct served_archive * s){
+    pthread_mutex_lock(&served_lock);
+    if (!--s -> users && s -> stale){
+        served_free(s);
+    }
+    pthread_mutex_unlock(&served_lock);
+}
 
+// answer a request with an error
+// returns 1 once the answer is sent, so callers can tell the request needs no other answer
+static int serve_error(const int sock, const char * fmt, ...){
+    char msg[TAR_PATH_MAX + 64];
+    int len = snprintf(msg, sizeof(msg), "ERR ");
+    va_list args;
+    va_start(args, fmt);
+    len += vsnprintf(msg + len, sizeof(msg) - len - 1, fmt, args);
+    va_end(args);
+    len = MIN(len, (int) sizeof(msg) - 2);
+    msg[len++] = '\n';
+    return (write_size(sock, msg, len) == len)?1:-1;
+}
 
-        case S_IFDIR:
-            memset(entry -> size, '0', 11);
-            entry -> type = DIRECTORY;
-            break;
-        case S_IFIFO:
-            entry -> type = FIFO;
-            break;
+static int serve_ok(const int sock, const unsigned long long size){
+    char line[32];
+    const int len = snprintf(line, sizeof(line), "OK %llu\n", size);
+    return (write_size(sock, line, len) == len)?0:-1;
+}
 
-        default:
-            entry -> type = -1;
-            ERROR("Error: Unknown filetype");
+static int serve_list(const int sock, const struct served_archive * s){
+    char * names = NULL;
+    size_t size = 0;
+    FILE * f = open_memstream(&names, &size);
+    if (!f){
+        return serve_error(sock, "%s", strerror(errno));
     }
+    for(const struct tar_t * entry = s -> archive.entries; entry; entry = entry -> next){
+        fprintf(f, "%s\n", tar_entry_name(entry));
+    }
+    fclose(f);
 
-    // get the checksum
-    calculate_checksum(entry);
-
-    return 0;
+    const int rc = ((serve_ok(sock, size) < 0) || (write_size(sock, names, size) != (int) size))?-1:0;
+    free(names);
+    return rc;
 }
 
-int write_end_data(const int fd, int size, const char verbosity){
-    if (fd < 0){
+static int serve_cat(const int sock, const struct served_archive * s, const char * name){
+    struct tar_reader reader;
+    if (tar_reader_open(&reader, &s -> archive, name) < 0){
+        return serve_error(sock, "Cannot read %s", name);
+    }
+
+    if (serve_ok(sock, reader.size) < 0){
         return -1;
     }
+    return stream_data(sock, s -> archive.fd, reader.data, reader.size);
+}
 
-    // complete current record
-    const int pad = RECORDSIZE - (size % RECORDSIZE);
-    for(int i = 0; i < pad; i++){
-        if (write(fd, "\0", 1) != 1){
-            V_PRINT(stderr, "Error: Unable to close tar file");
+// open the directory a member goes into, creating it below root as needed
+// no component is followed through a symbolic link, so an extracted link cannot lead elsewhere
+// returns the directory's descriptor, with *base set to the member's last component
+static int serve_parent(const int root, const char * name, const char ** base){
+    int dir = dup(root);
+    const char * part = name;
+    for(const char * slash; (dir >= 0) && (slash = strchr(part, '/')); part = slash + 1){
+        if (slash == part){
+            continue;
+        }
+
+        char component[NAME_MAX + 1];
+        if (slash - part > NAME_MAX){
+            close(dir);
+            errno = ENAMETOOLONG;
             return -1;
         }
-    }
+        memcpy(component, part, slash - part);
+        component[slash - part] = '\0';
 
-    // if the current record does not have 2 blocks of zeros, add a whole other record
-    if (pad < (2 * BLOCKSIZE)){
-        for(int i = 0; i < RECORDSIZE; i++){
-            if (write(fd, "\0", 1) != 1){
-                V_PRINT(stderr, "Error: Unable to close tar file");
-                return -1;
-            }
+        if ((mkdirat(dir, component, DEFAULT_DIR_MODE) < 0) && (errno != EEXIST)){
+            const int rc = errno;
+            close(dir);
+            errno = rc;
+            return -1;
         }
-        return pad + RECORDSIZE;
+        const int next = openat(dir, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        const int rc = errno;
+        close(dir);
+        errno = rc;
+        dir = next;
     }
 
-    return pad;
+    *base = part;
+    return dir;
 }
 
+// write one member below the directory root
+// returns 0 if it was written, 1 if an error was answered instead
+static int serve_extract_one(const int sock, const struct served_archive * s, const int root, const char * name){
+    const struct tar_t * entry = tar_lookup(&s -> archive, name);
+    if (!entry){
+        return serve_error(sock, "'%s' not found in archive", name);
+    }
+
+    // members are written below root only
+    for(const char * part = name; part; part = strchr(part, '/')){
+        part += (part != name);
+        if ((*name == '/') || !strncmp(part, "../", 3) || !strcmp(part, "..")){
+            return serve_error(sock, "Refusing to extract %s", name);
+        }
+    }
 
-unsigned int calculate_checksum(struct tar_t * entry){
-    // use spaces for the checksum bytes while calculating the checksum
-    memset(entry -> check, ' ', 8);
+    const char * base;
+    const int dir = serve_parent(root, name, &base);
+    if (dir < 0){
+        return serve_error(sock, "Cannot create directory for %s: %s", name, strerror(errno));
+    }
 
-    // sum of entire metadata
-    unsigned int check = 0;
-    for(int i = 0; i < 512; i++){
-        check += (unsigned char) entry -> block[i];
+    int rc = 0;
+    if (entry -> type == DIRECTORY){
+        if (*base && (mkdirat(dir, base, DEFAULT_DIR_MODE) < 0) && (errno != EEXIST)){
+            rc = serve_error(sock, "Cannot create %s: %s", name, strerror(errno));
+        }
+    }
+    else if (entry -> type == SYMLINK){
+        unlinkat(dir, base, 0);
+        if (symlinkat(tar_entry_link(entry), dir, base) < 0){
+            rc = serve_error(sock, "Cannot create %s: %s", name, strerror(errno));
+        }
     }
+    else{
+        struct tar_reader reader;
+        int f = -1;
+        if (tar_reader_open(&reader, &s -> archive, name) < 0){
+            rc = serve_error(sock, "Cannot read %s", name);
+        }
+        else if ((f = openat(dir, base, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, tar_get_mode(entry) & 0777)) < 0){
+            rc = serve_error(sock, "Cannot create %s: %s", name, strerror(errno));
+        }
+        else if ((copy_range(s -> archive.fd, reader.data, f, 0, reader.size) < 0) || (ftruncate(f, reader.size) < 0)){
+            rc = serve_error(sock, "Cannot write %s: %s", name, strerror(errno));
+        }
+        else{
+            restore_entry(f, entry);
+        }
 
-    snprintf(entry -> check, sizeof(entry -> check), "%06o0", check);
+        if (f >= 0){
+            close(f);
+        }
+    }
+    close(dir);
 
-    entry -> check[6] = '\0';
-    entry -> check[7] = ' ';
-    return check;
+    return rc;
 }
 
+// handle the requests of one client, one line each, until it disconnects
+static void * serve_client(void * arg){
+    const int sock = (int) (intptr_t) arg;
+    const char verbosity = 0;
+    FILE * in = fdopen(sock, "r");
+    char * line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+
+    while (in && ((len = getline(&line, &capacity, in)) > 0)){
+        line[len - 1] = (line[len - 1] == '\n')?'\0':line[len - 1];
+
+        // fields are separated by tabs: command, archive, then arguments
+        char * fields[3 + TAR_PATH_MAX / 2];
+        int count = 0;
+        for(char * field = line; field && (count < (int) (sizeof(fields) / sizeof(fields[0]))); count++){
+            fields[count] = field;
+            if ((field = strchr(field, '\t'))){
+                *field++ = '\0';
+            }
+        }
 
-int tar_update(const int fd, struct tar_t ** archive, const size_t filecount, const char * files[], const char verbosity){
-    if (!filecount){
-        return 0;
+        struct served_archive * s = (count >= 2)?served_get(fields[1], verbosity):NULL;
+        int rc;
+        if (!s){
+            rc = serve_error(sock, "Cannot open archive %s", (count >= 2)?fields[1]:"");
+        }
+        else if (!strcmp(fields[0], "list")){
+            rc = serve_list(sock, s);
+        }
+        else if (!strcmp(fields[0], "cat") && (count == 3)){
+            rc = serve_cat(sock, s, fields[2]);
+        }
+        else if (!strcmp(fields[0], "extract") && (count >= 4)){
+            const int root = (recursive_mkdir(fields[2], DEFAULT_DIR_MODE, 0) < 0)?-1:open(fields[2], O_RDONLY | O_DIRECTORY);
+            rc = (root < 0)?serve_error(sock, "Cannot open %s: %s", fields[2], strerror(errno)):0;
+            for(int i = 3; (i < count) && !rc; i++){
+                rc = serve_extract_one(sock, s, root, fields[i]);
+            }
+            if (root >= 0){
+                close(root);
+            }
+            // an error was already answered
+            if (!rc){
+                rc = serve_ok(sock, 0);
+            }
+        }
+        else{
+            rc = serve_error(sock, "Bad request %s", fields[0]);
+        }
+
+        if (s){
+            served_put(s);
+        }
+        if (rc < 0){
+            break;
+        }
     }
 
-    if (filecount && !files){
-        ERROR("Non-zero file count provided, but file list is NULL");
+    free(line);
+    if (in){
+        fclose(in);
+    }
+    else{
+        close(sock);
     }
+    return NULL;
+}
 
-    // buffer for subset of files that need to be updated
-    char ** newer = calloc(filecount, sizeof(char *));
+int tar_serve(const char * path, const char verbosity){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)){
+        ERROR("Socket path too long: %s", path);
+    }
+    strcpy(addr.sun_path, path);
+
+    const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0){
+        RC_ERROR("Unable to create socket: %s", strerror(rc));
+    }
 
+    // a socket left behind by an earlier server is replaced
     struct stat st;
-    int count = 0;
-    int all = 1;
+    if (!lstat(path, &st) && S_ISSOCK(st.st_mode)){
+        unlink(path);
+    }
 
-    // check each source to see if it was updated
-    struct tar_t * tar = *archive;
-    for(int i = 0; i < filecount; i++){
-        // make sure original file exists
-        if (stat(files[i], &st)){
-            all = 0;
-            RC_ERROR("Could not stat %s: %s", files[i], strerror(rc));
-        }
+    // only the owner may send requests, since files are written with the server's permissions
+    if ((bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) || (chmod(path, 0600) < 0) || (listen(sock, 64) < 0)){
+        const int rc = errno;
+        close(sock);
+        ERROR("Unable to listen on %s: %s", path, strerror(rc));
+    }
 
-        // find the file in the archive
-        struct tar_t * old = exists(tar, files[i], 1);
-        newer[count] = calloc(strlen(files[i]) + 1, sizeof(char));
+    // clients that go away must not take the server with them
+    signal(SIGPIPE, SIG_IGN);
+    V_PRINT(stderr, "Serving on %s", path);
 
-        // if there is an older version, check its timestamp
-        if (old){
-            if (st.st_mtime > oct2uint(old -> mtime, 11)){
-                strncpy(newer[count++], files[i], strlen(files[i]));
-                V_PRINT(stdout, "%s", files[i]);
+    while (1){
+        const int client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0){
+            if (errno == EINTR){
+                continue;
             }
+            const int rc = errno;
+            close(sock);
+            ERROR("Unable to accept: %s", strerror(rc));
         }
-        // if there is no older version, just add it
-        else{
-            strncpy(newer[count++], files[i], strlen(files[i]));
-            V_PRINT(stdout, "%s", files[i]);
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_client, (void *) (intptr_t) client)){
+            close(client);
+            continue;
         }
+        pthread_detach(thread);
     }
+}
 
-    // update listed files only
-    if (tar_write(fd, archive, count, (const char **) newer, verbosity) < 0){
-        ERROR("Unable to update archive");
+int tar_query(const char * path, int count, const char * fields[], const int out){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ((sock < 0) || (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)){
+        const int rc = errno;
+        if (sock >= 0){
+            close(sock);
+        }
+        ERROR("Unable to connect to %s: %s", path, strerror(rc));
     }
 
-    // cleanup
+    // one request line
+    size_t len = 0;
     for(int i = 0; i < count; i++){
-        free(newer[i]);
+        len += strlen(fields[i]) + 1;
+    }
+    char * request = malloc(len + 1);
+    len = 0;
+    for(int i = 0; i < count; i++){
+        len += sprintf(request + len, "%s%c", fields[i], (i + 1 < count)?'\t':'\n');
+    }
+    const int sent = write_size(sock, request, len) == (int) len;
+    free(request);
+
+    // "OK <size>" and size bytes of answer, or "ERR <message>"
+    char line[TAR_PATH_MAX + 64];
+    size_t used = 0;
+    while (sent && (used < sizeof(line) - 1) && (read_size(sock, line + used, 1) == 1) && (line[used] != '\n')){
+        used++;
+    }
+    line[used] = '\0';
+
+    int rc = -1;
+    if (!strncmp(line, "OK ", 3)){
+        unsigned long long size = strtoull(line + 3, NULL, 10);
+        char buf[65536];
+        while (size){
+            const int want = MIN(size, sizeof(buf));
+            if ((read_size(sock, buf, want) != want) || (write_size(out, buf, want) != want)){
+                break;
+            }
+            size -= want;
+        }
+        rc = size?-1:0;
+    }
+    else{
+        fprintf(stderr, "Error: %s\n", strncmp(line, "ERR ", 4)?"No answer":line + 4);
     }
-    free(newer);
 
-    return all?0:-1;
+    close(sock);
+    return rc;
 }
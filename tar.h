@@ -28,13 +28,56 @@
 #define DIRECTORY       '5'
 #define FIFO            '6'
 #define CONTIGUOUS      '7'
+#define PAX_HEADER      'x'             // PAX extended header for the next entry
+#define PAX_GLOBAL      'g'             // PAX extended header for all following entries
+#define GNU_LONGNAME    'L'             // GNU header whose data is the next entry's name
+#define GNU_LONGLINK    'K'             // GNU header whose data is the next entry's link target
+
+// longest name or link target kept from extended headers
+#define TAR_PATH_MAX    4096
+
+// how names that do not fit in a ustar header are written
+#define FORMAT_PAX       0
+#define FORMAT_GNU       1
+
+// per-member payload digests (stored in PAX records)
+#define DIGEST_NONE      0
+#define DIGEST_CRC32C    1
+#define DIGEST_KEYWORD  "TAR.crc32c"
+
+// options that change how archives are written
+struct tar_options {
+    char digest;                            // digest to compute while writing member data
+    char uring;                             // batch small file I/O through io_uring when available
+    char low_impact;                        // keep archived files and the archive out of the page cache
+    char direct;                            // read files being archived with O_DIRECT
+    unsigned long long bwlimit;             // most bytes per second read or written (0: unlimited)
+    unsigned int iops;                      // most read or write operations per second (0: unlimited)
+    char format;                            // extended header type used for long names
+    const char ** exclude;                  // patterns of names left out when creating, listing and extracting
+    int exclude_count;
+    const char ** rename;                   // "OLD=NEW" rules for names of transformed members
+    int rename_count;
+    const char * owner;                     // owner of written members, "NAME" or "NAME:UID" (NULL: unchanged)
+    const char * group;                     // group of written members, "NAME" or "NAME:GID"
+    const char * checkpoint;                // file recording how far creating or extracting got (NULL: none)
+    char resume;                            // continue from the checkpoint of an interrupted run
+    char occurrence;                        // tar_stream writes the first copy of a name instead of the newest
+};
+
+extern struct tar_options tar_opts;
 
 
 
 struct tar_t {
 
-    char original_name[100];                // original filenme; only availible when writing into a tar
+    const char * original_name;             // original filenme; only availible when writing into a tar
+    char * long_name;                       // full name when name alone does not hold it (NULL otherwise)
+    char * long_link;                       // full link target when link_name alone does not hold it
     unsigned int begin;                     // location of data in file (including metadata)
+    unsigned int extended;                  // size of extended headers stored right before begin
+    char digest;                            // type of payload digest found in extended headers
+    unsigned int crc32c;                    // payload digest (if digest == DIGEST_CRC32C)
     union {
         union {
             // Pre-POSIX.1-1988 format
@@ -70,9 +113,192 @@ struct tar_t {
     struct tar_t * next;
 };
 
+// header layouts, told apart by their magic; each one extends the one before it
+#define HEADER_V7        0
+#define HEADER_USTAR     1              // also the layout of PAX archives
+#define HEADER_GNU       2
+
+// numeric header fields and the first layout that has them: X(field, layout)
+// widths come from the fields themselves, so no reader or writer spells them out
+#define TAR_NUMERIC_FIELDS(X)           \
+    X(mode,  HEADER_V7)                 \
+    X(uid,   HEADER_V7)                 \
+    X(gid,   HEADER_V7)                 \
+    X(size,  HEADER_V7)                 \
+    X(mtime, HEADER_V7)                 \
+    X(check, HEADER_V7)                 \
+    X(major, HEADER_USTAR)              \
+    X(minor, HEADER_USTAR)
+
+// write value as zero padded octal of exactly digits characters followed by a NUL
+// returns -1 if value does not fit (the field then holds its low digits)
+static inline int tar_octal_encode(char * field, const size_t digits, unsigned long long value){
+    for(size_t i = digits; i; i--){
+        field[i - 1] = '0' + (value & 7);
+        value >>= 3;
+    }
+    field[digits] = '\0';
+    return value?-1:0;
+}
+
+// read up to digits octal digits after optional leading spaces; the first other character ends the number
+static inline unsigned long long tar_octal_decode(const char * field, const size_t digits){
+    size_t i = 0;
+    while ((i < digits) && (field[i] == ' ')){
+        i++;
+    }
+
+    unsigned long long out = 0;
+    for(; i < digits; i++){
+        const unsigned int digit = (unsigned char) field[i] - '0';
+        if (digit > 7){
+            break;
+        }
+        out = (out << 3) | digit;
+    }
+    return out;
+}
+
+// tar_get_<field>(entry) and tar_set_<field>(entry, value) for every numeric field
+#define TAR_FIELD_CODEC(field, layout)                                                              \
+    static inline unsigned long long tar_get_##field(const struct tar_t * entry){                   \
+        return tar_octal_decode(entry -> field, sizeof(entry -> field) - 1);                        \
+    }                                                                                               \
+    static inline int tar_set_##field(struct tar_t * entry, const unsigned long long value){        \
+        return tar_octal_encode(entry -> field, sizeof(entry -> field) - 1, value);                 \
+    }
+TAR_NUMERIC_FIELDS(TAR_FIELD_CODEC)
+#undef TAR_FIELD_CODEC
+
+// layout of a header
+int tar_header_layout(const struct tar_t * entry);
+
+// full name of an entry, including ustar prefix or extended header names
+static inline const char * tar_entry_name(const struct tar_t * entry){
+    return entry -> long_name?entry -> long_name:entry -> name;
+}
+
+// full link target of an entry
+static inline const char * tar_entry_link(const struct tar_t * entry){
+    return entry -> long_link?entry -> long_link:entry -> link_name;
+}
+
+// storage for the names of the entry an iterator returned last
+struct tar_names {
+    char name[TAR_PATH_MAX];
+    char link[TAR_PATH_MAX];
+};
+
+// lazy walk over the headers of an archive
+struct tar_iter {
+    int fd;
+    unsigned int offset;                    // archive offset of the next header
+    unsigned int pos;                       // current offset of fd (used when it cannot seek)
+    char done;                              // end of archive was reached
+    char verbosity;
+    struct tar_names names;                 // long names of the current entry
+};
+
+// archive opened once for random access
+// lookups and readers only use pread, so they can be shared between threads
+struct tar_archive {
+    int fd;
+    int count;                              // number of entries
+    struct tar_t * entries;                 // entries in archive order
+    struct tar_t ** index;                  // open addressed hash table of entries by name
+    unsigned int buckets;                   // size of index (power of 2)
+};
+
+// position independent reader over the data of a single member
+struct tar_reader {
+    const struct tar_archive * archive;
+    const struct tar_t * entry;
+    off_t data;                             // archive offset of member data
+    off_t size;                             // size of member data
+    off_t pos;                              // position used by tar_reader_read
+};
+
+// directory known to exist while extracting
+struct tar_dir {
+    char * path;
+    int fd;                                 // open descriptor or -1 once closed
+    char restore;                           // metadata below came from the archive and is still to be applied
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+};
+
+// state shared by all entries of one extraction
+// directories are created once and files are opened relative to their parent's descriptor
+struct tar_extract_ctx {
+    struct tar_dir * dirs;                  // open addressed hash table of directories by path
+    unsigned int buckets;                   // size of dirs (power of 2)
+    unsigned int count;                     // number of directories
+    unsigned int open;                      // number of open descriptors
+    mode_t umask;                           // bits removed from restored directory permissions
+};
+
+// archive built in memory, into a buffer that grows or one the caller provides
+// resetting keeps the memory, so building archive after archive in the same buffer does not allocate
+struct tar_buffer {
+    char * data;
+    size_t size;                            // bytes of archive in data
+    size_t capacity;
+    char fixed;                             // data belongs to the caller and cannot grow
+};
+
+// member of an archive held in memory
+// name and link point into the iterator and are replaced by the next call; data points into the archive
+struct tar_mem_member {
+    const char * name;
+    const char * link;
+    const char * data;
+    size_t size;
+    unsigned int mode;
+    time_t mtime;
+    char type;
+};
+
+// walk over an archive held in memory without copying member data
+struct tar_mem_iter {
+    const char * data;
+    size_t size;
+    size_t pos;                             // offset of the next header
+    struct tar_t entry;                     // current header
+    struct tar_names names;                 // long names of the current member
+};
+
 
 int tar_read(const int fd, struct tar_t ** archive, const char verbosity);
 
+// start walking an archive from its beginning
+int tar_iter_init(struct tar_iter * iter, const int fd, const char verbosity);
+
+// read the next entry header; returns 1 with entry filled in, 0 at end of archive, -1 on error
+// on seekable files the fd is left at the entry's data and may be moved freely
+// long names of the entry point into the iterator and are replaced by the next call
+int tar_iter_next(struct tar_iter * iter, struct tar_t * entry);
+
+// visit matching entries lazily, every copy of a name in archive order (so the newest is visited last)
+// visit returns -1 on error; on pipes, a visitor that reads member data returns how many bytes it read
+int tar_walk(const int fd, int filecount, const char * files[], int (*visit)(const int fd, struct tar_t * entry, void * arg), void * arg, const char verbosity);
+
+// like tar_walk, but if the list names only files, stops once each of them was visited (the first copy)
+int tar_walk_first(const int fd, int filecount, const char * files[], int (*visit)(const int fd, struct tar_t * entry, void * arg), void * arg, const char verbosity);
+
+// tar_extract, tar_ls and print_tar_metadata without reading the whole archive first
+int tar_extract_lazy(const int fd, int filecount, const char * files[], const char verbosity);
+
+// write the contents of matching regular members to out, one after another, without creating files
+// only the newest copy of a name is written, unless the archive is a pipe or tar_opts.occurrence is set
+// (then the first copy is written and reading stops once every named file was found)
+int tar_stream(const int fd, int filecount, const char * files[], const int out, const char verbosity);
+
+int tar_ls_lazy(const int fd, int filecount, const char * files[], const char verbosity);
+
+int print_tar_metadata_lazy(const int fd, int filecount, const char * files[], const char verbosity);
+
 int write_entries(const int fd, struct tar_t ** archive, struct tar_t ** head, const size_t filecount, const char * files[], int * offset, const char verbosity);
 
 int tar_ls(FILE * f, struct tar_t * archive, int filecount, const char * files[], const char verbosity);
@@ -83,18 +309,51 @@ int tar_extract(const int fd, struct tar_t * archive, int filecount, const char
 
 int extract_entry(const int fd, struct tar_t * entry, const char verbosity);
 
+// owner of an entry; names from the header win over the numeric ids when they are known here
+uid_t tar_entry_uid(const struct tar_t * entry);
+
+gid_t tar_entry_gid(const struct tar_t * entry);
+
+int extract_ctx_init(struct tar_extract_ctx * ctx);
+
+// restore metadata of extracted directories, deepest first
+// files get theirs as they are written, but directories change until extraction is over
+int extract_ctx_finish(struct tar_extract_ctx * ctx);
+
+void extract_ctx_free(struct tar_extract_ctx * ctx);
+
+// descriptor of a directory, creating it and any missing parents (AT_FDCWD for an empty path)
+int extract_dir(struct tar_extract_ctx * ctx, const char * path, size_t len, const char verbosity);
+
+// extract_entry using directories already created by earlier entries
+int extract_entry_ctx(struct tar_extract_ctx * ctx, const int fd, struct tar_t * entry, const char verbosity);
+
 int tar_remove(const int fd, struct tar_t ** archive, int filecount, const char * files[], const char verbosity);
 
 int tar_diff(FILE * f, struct tar_t * archive, const char verbosity);
 
 int check_match(struct tar_t * entry, int filecount, const char * files[]);
 
-// convert octal string to unsigned integer
+// convert octal string to unsigned integer (header fields have tar_get_<field>)
 unsigned int oct2uint(char * oct, unsigned int size);
 
 // force read() to complete
 int read_size(int fd, char * buf, int size);
 
+// force pread() to complete; does not move the file offset
+int pread_size(int fd, char * buf, int size, off_t offset);
+
+// CRC32C (Castagnoli) of a buffer, continuing from crc (start with 0)
+unsigned int tar_crc32c(unsigned int crc, const char * buf, size_t size);
+
+// check payload digests and header checksums of every entry using multiple threads
+int tar_verify(const int fd, struct tar_t * archive, int threads, const char verbosity);
+
+// print "name:offset" for every place the pattern (a fixed string, or an extended regular expression
+// matched per line) occurs in the data of matching members; members are searched in place by several threads
+// returns the number of matches
+int tar_search(const int fd, struct tar_t * archive, int filecount, const char * files[], const char * pattern, const char regex, int threads, const char verbosity);
+
 // recursive freeing of entries
 void tar_free(struct tar_t * archive);
 
@@ -113,10 +372,78 @@ int tar_write(const int fd, struct tar_t ** archive, int filecount, const char *
 
 int write_end_data(const int fd, int size, const char verbosity);
 
-int format_tar_data(struct tar_t * entry, const char * filename, const char verbosity);
+// fill in a header for filename; names that need more than the header holds are copied to
+// long_name, which must have room for strlen(filename) + 2 bytes (may be NULL for short names)
+// filename is kept as the entry's original name
+int format_tar_data(struct tar_t * entry, const char * filename, char * long_name, const char verbosity);
 
 int recursive_mkdir(const char * dir, const unsigned int mode, const char verbosity);
 
 int tar_update(const int fd, struct tar_t ** archive, const size_t filecount, const char * files[], const char verbosity);
 
+// copy the matching members of one archive into another in a single pass, renaming them and changing
+// their owner as set in tar_opts; member data is passed through unchanged; works on pipes
+int tar_transform(const int in, const int out, int filecount, const char * files[], const char verbosity);
+
+// write files into shards separate archives <base>.0 ... <base>.N-1 at the same time, balanced by size,
+// and list which shard holds each member in <base>.manifest; every shard can be extracted on its own
+int tar_write_shards(const char * base, int shards, int filecount, const char * files[], const char verbosity);
+
+// extract the shards of a sharded archive in parallel; with a file list, only shards holding matches are read
+int tar_extract_shards(const char * base, int filecount, const char * files[], const char verbosity);
+
+// append the members of other archives to an archive, replacing its end of archive blocks
+// member data is copied with copy_file_range where possible and the index is updated in place
+int tar_concatenate(const int fd, struct tar_t ** archive, int count, const char * sources[], const char verbosity);
+
+// open an archive for random access and index its entries by name
+int tar_open(struct tar_archive * archive, const char * path, const char verbosity);
+
+// find the newest entry with the given name
+struct tar_t * tar_lookup(const struct tar_archive * archive, const char * name);
+
+// create a reader over the data of a member; hard links read their target
+int tar_reader_open(struct tar_reader * reader, const struct tar_archive * archive, const char * name);
+
+// read member data at offset without touching any shared position
+ssize_t tar_reader_pread(const struct tar_reader * reader, char * buf, size_t size, off_t offset);
+
+// read member data from the reader's own position
+ssize_t tar_reader_read(struct tar_reader * reader, char * buf, size_t size);
+
+// release the index and close the archive
+void tar_close(struct tar_archive * archive);
+
+// start an archive in data (capacity bytes, used as is) or, if data is NULL, in memory of its own
+void tar_buffer_init(struct tar_buffer * buf, char * data, const size_t capacity);
+
+// empty the buffer for the next archive, keeping its memory
+void tar_buffer_reset(struct tar_buffer * buf);
+
+void tar_buffer_free(struct tar_buffer * buf);
+
+// append a member holding size bytes of data; names ending in '/' add a directory
+// returns -1 with errno ENOSPC if a caller provided buffer is full (the buffer is left unchanged)
+int tar_buffer_add(struct tar_buffer * buf, const char * name, const void * data, const size_t size, const unsigned int mode, const time_t mtime);
+
+// append the end of archive blocks; buf -> data then holds size bytes of complete archive
+int tar_buffer_finish(struct tar_buffer * buf);
+
+void tar_mem_iter_init(struct tar_mem_iter * iter, const void * data, const size_t size);
+
+// read the next member; returns 1 with member filled in, 0 at end of archive, -1 if the archive is damaged
+int tar_mem_next(struct tar_mem_iter * iter, struct tar_mem_member * member);
+
+// serve requests on a Unix socket until killed, keeping every archive asked for open and indexed;
+// an archive is read again once its size or modification time changes
+// each request is one line of tab separated fields, answered with "OK <size>\n" and size bytes,
+// or "ERR <message>\n":
+//   list    ARCHIVE                        member names, one per line
+//   cat     ARCHIVE  MEMBER                member data
+//   extract ARCHIVE  DIR  MEMBER...        write the members below DIR (nothing is sent back)
+int tar_serve(const char * path, const char verbosity);
+
+// send a request made of the given fields to a server and copy the answer to out
+int tar_query(const char * path, int count, const char * fields[], const int out);
+
 #endif // TAR_H_INCLUDED
@@ -0,0 +1,400 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+// submission and completion rings shared with the kernel
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned queued;                        // entries prepared but not yet published
+
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_array;
+    struct io_uring_sqe * sqes;
+
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    struct io_uring_cqe * cqes;
+
+    void * sq_ring;
+    size_t sq_ring_size;
+    void * cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+// one ring per thread; a failed setup is remembered so the sync path is used from then on
+static __thread struct uring * ring;
+static __thread char ring_failed;
+
+static void ring_free(struct uring * r){
+    if (r -> sqes && (r -> sqes != MAP_FAILED)){
+        munmap(r -> sqes, r -> sqes_size);
+    }
+    if (r -> cq_ring && (r -> cq_ring != MAP_FAILED) && (r -> cq_ring != r -> sq_ring)){
+        munmap(r -> cq_ring, r -> cq_ring_size);
+    }
+    if (r -> sq_ring && (r -> sq_ring != MAP_FAILED)){
+        munmap(r -> sq_ring, r -> sq_ring_size);
+    }
+    if (r -> fd >= 0){
+        close(r -> fd);
+    }
+    free(r);
+}
+
+static struct uring * ring_setup(const unsigned entries){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    struct uring * r = calloc(1, sizeof(struct uring));
+    r -> fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r -> fd < 0){
+        ring_free(r);
+        return NULL;
+    }
+
+    r -> sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r -> cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+        r -> sq_ring_size = r -> cq_ring_size = (r -> sq_ring_size > r -> cq_ring_size)?r -> sq_ring_size:r -> cq_ring_size;
+    }
+
+    r -> sq_ring = mmap(NULL, r -> sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r -> fd, IORING_OFF_SQ_RING);
+    if (r -> sq_ring == MAP_FAILED){
+        ring_free(r);
+        return NULL;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+        r -> cq_ring = r -> sq_ring;
+    }
+    else{
+        r -> cq_ring = mmap(NULL, r -> cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r -> fd, IORING_OFF_CQ_RING);
+        if (r -> cq_ring == MAP_FAILED){
+            ring_free(r);
+            return NULL;
+        }
+    }
+
+    r -> sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r -> sqes = mmap(NULL, r -> sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r -> fd, IORING_OFF_SQES);
+    if (r -> sqes == MAP_FAILED){
+        ring_free(r);
+        return NULL;
+    }
+
+    char * sq = r -> sq_ring;
+    char * cq = r -> cq_ring;
+    r -> sq_head = (unsigned *) (sq + p.sq_off.head);
+    r -> sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    r -> sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    r -> sq_array = (unsigned *) (sq + p.sq_off.array);
+    r -> cq_head = (unsigned *) (cq + p.cq_off.head);
+    r -> cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    r -> cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    r -> cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    r -> entries = p.sq_entries;
+
+    // submission slots always map to the sqe with the same index
+    for(unsigned i = 0; i < p.sq_entries; i++){
+        r -> sq_array[i] = i;
+    }
+
+    return r;
+}
+
+int uring_available(void){
+    if (!ring && !ring_failed){
+        ring = ring_setup(2 * URING_BATCH);
+        ring_failed = !ring;
+    }
+    return ring != NULL;
+}
+
+void uring_release(void){
+    if (ring){
+        ring_free(ring);
+        ring = NULL;
+    }
+}
+
+// get a cleared submission entry tagged with an index into the batch
+static struct io_uring_sqe * ring_sqe(const unsigned char opcode, const int index){
+    const unsigned head = __atomic_load_n(ring -> sq_head, __ATOMIC_ACQUIRE);
+    const unsigned tail = *ring -> sq_tail + ring -> queued;
+    if (tail - head >= ring -> entries){
+        return NULL;
+    }
+
+    struct io_uring_sqe * sqe = &ring -> sqes[tail & *ring -> sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe -> opcode = opcode;
+    sqe -> user_data = index;
+    ring -> queued++;
+    return sqe;
+}
+
+// submit everything queued and wait for all of it; results[user_data] receives each result
+static int ring_wait_all(int * results){
+    unsigned submit = ring -> queued;
+    unsigned pending = ring -> queued;
+    __atomic_store_n(ring -> sq_tail, *ring -> sq_tail + ring -> queued, __ATOMIC_RELEASE);
+    ring -> queued = 0;
+
+    while (pending){
+        const int rc = syscall(__NR_io_uring_enter, ring -> fd, submit, pending, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        submit -= (rc < submit)?rc:submit;
+
+        unsigned head = *ring -> cq_head;
+        while (head != __atomic_load_n(ring -> cq_tail, __ATOMIC_ACQUIRE)){
+            const struct io_uring_cqe * cqe = &ring -> cqes[head & *ring -> cq_mask];
+            results[cqe -> user_data] = cqe -> res;
+            head++;
+            pending--;
+        }
+        __atomic_store_n(ring -> cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+static void statx_to_stat(const struct statx * sx, struct stat * st){
+    memset(st, 0, sizeof(struct stat));
+    st -> st_mode = sx -> stx_mode;
+    st -> st_nlink = sx -> stx_nlink;
+    st -> st_uid = sx -> stx_uid;
+    st -> st_gid = sx -> stx_gid;
+    st -> st_size = sx -> stx_size;
+    st -> st_ino = sx -> stx_ino;
+    st -> st_dev = makedev(sx -> stx_dev_major, sx -> stx_dev_minor);
+    st -> st_rdev = makedev(sx -> stx_rdev_major, sx -> stx_rdev_minor);
+    st -> st_atim.tv_sec = sx -> stx_atime.tv_sec;
+    st -> st_atim.tv_nsec = sx -> stx_atime.tv_nsec;
+    st -> st_mtim.tv_sec = sx -> stx_mtime.tv_sec;
+    st -> st_mtim.tv_nsec = sx -> stx_mtime.tv_nsec;
+    st -> st_ctim.tv_sec = sx -> stx_ctime.tv_sec;
+    st -> st_ctim.tv_nsec = sx -> stx_ctime.tv_nsec;
+}
+
+int uring_stat_files(struct uring_file * files, const int count){
+    if ((count > URING_BATCH) || !uring_available()){
+        return -1;
+    }
+
+    struct statx sx[URING_BATCH];
+    int results[URING_BATCH];
+    for(int i = 0; i < count; i++){
+        struct io_uring_sqe * sqe = ring_sqe(IORING_OP_STATX, i);
+        sqe -> fd = files[i].dirfd;
+        sqe -> addr = (unsigned long) files[i].path;
+        sqe -> len = STATX_BASIC_STATS;
+        sqe -> off = (unsigned long) &sx[i];
+        results[i] = -ECANCELED;
+    }
+
+    if (ring_wait_all(results) < 0){
+        return -1;
+    }
+
+    for(int i = 0; i < count; i++){
+        files[i].result = results[i];
+        if (!results[i]){
+            statx_to_stat(&sx[i], &files[i].st);
+        }
+    }
+
+    return 0;
+}
+
+int uring_read_files(struct uring_file * files, const int count){
+    if ((count > URING_BATCH) || !uring_available()){
+        return -1;
+    }
+
+    int fds[URING_BATCH];
+    int results[URING_BATCH];
+
+    // open
+    for(int i = 0; i < count; i++){
+        fds[i] = -1;
+        results[i] = -ECANCELED;
+        files[i].data = NULL;
+        files[i].size = 0;
+        if (files[i].result || !S_ISREG(files[i].st.st_mode)){
+            continue;
+        }
+
+        struct io_uring_sqe * sqe = ring_sqe(IORING_OP_OPENAT, i);
+        sqe -> fd = files[i].dirfd;
+        sqe -> addr = (unsigned long) files[i].path;
+        sqe -> open_flags = O_RDONLY;
+    }
+    if (ring_wait_all(results) < 0){
+        return -1;
+    }
+
+    // read whole files at once
+    for(int i = 0; i < count; i++){
+        if (files[i].result || !S_ISREG(files[i].st.st_mode)){
+            continue;
+        }
+
+        if (results[i] < 0){
+            files[i].result = results[i];
+            continue;
+        }
+        fds[i] = results[i];
+        files[i].size = files[i].st.st_size;
+        files[i].data = malloc(files[i].size + 1);
+
+        struct io_uring_sqe * sqe = ring_sqe(IORING_OP_READ, i);
+        sqe -> fd = fds[i];
+        sqe -> addr = (unsigned long) files[i].data;
+        sqe -> len = files[i].size;
+        sqe -> off = 0;
+        results[i] = -ECANCELED;
+    }
+    if (ring_wait_all(results) < 0){
+        return -1;
+    }
+
+    // close
+    for(int i = 0; i < count; i++){
+        if (fds[i] < 0){
+            continue;
+        }
+
+        stats_add(STAT_READS, 1);
+        if (results[i] >= 0){
+            stats_add(STAT_BYTES_READ, results[i]);
+        }
+
+        // a short read means the file changed; let the caller fall back
+        if (results[i] != (int) files[i].size){
+            files[i].result = (results[i] < 0)?results[i]:-EAGAIN;
+            free(files[i].data);
+            files[i].data = NULL;
+        }
+
+        struct io_uring_sqe * sqe = ring_sqe(IORING_OP_CLOSE, i);
+        sqe -> fd = fds[i];
+    }
+
+    return ring_wait_all(results);
+}
+
+int uring_write_files(struct uring_file * files, const int count, int (*finish)(const int fd, struct uring_file * file, void * arg), void * arg){
+    if ((count > URING_BATCH) || !uring_available()){
+        return -1;
+    }
+
+    int fds[URING_BATCH];
+    int results[URING_BATCH];
+
+    // create
+    for(int i = 0; i < count; i++){
+        fds[i] = -1;
+        results[i] = -ECANCELED;
+        struct io_uring_sqe * sqe = ring_sqe(IORING_OP_OPENAT, i);
+        sqe -> fd = files[i].dirfd;
+        sqe -> addr = (unsigned long) files[i].path;
+        sqe -> open_flags = files[i].flags;
+        sqe -> len = files[i].mode;
+    }
+    if (ring_wait_all(results) < 0){
+        return -1;
+    }
+
+    // write
+    for(int i = 0; i < count; i++){
+        files[i].result = (results[i] < 0)?results[i]:0;
+        if (results[i] < 0){
+            continue;
+        }
+        fds[i] = results[i];
+        results[i] = 0;
+
+        if (files[i].size){
+            struct io_uring_sqe * sqe = ring_sqe(IORING_OP_WRITE, i);
+            sqe -> fd = fds[i];
+            sqe -> addr = (unsigned long) files[i].data;
+            sqe -> len = files[i].size;
+            sqe -> off = 0;
+            results[i] = -ECANCELED;
+        }
+    }
+    if (ring_wait_all(results) < 0){
+        return -1;
+    }
+
+    // finish and close
+    for(int i = 0; i < count; i++){
+        if (fds[i] < 0){
+            continue;
+        }
+
+        if (files[i].size){
+            stats_add(STAT_WRITES, 1);
+        }
+        if (results[i] >= 0){
+            stats_add(STAT_BYTES_WRITTEN, results[i]);
+        }
+
+        if ((size_t) results[i] != files[i].size){
+            files[i].result = (results[i] < 0)?results[i]:-EIO;
+        }
+        else if (finish && (finish(fds[i], &files[i], arg) < 0)){
+            files[i].result = -errno;
+        }
+
+        struct io_uring_sqe * sqe = ring_sqe(IORING_OP_CLOSE, i);
+        sqe -> fd = fds[i];
+    }
+
+    return ring_wait_all(results);
+}
+
+#else
+
+int uring_available(void){
+    return 0;
+}
+
+int uring_stat_files(struct uring_file * files, const int count){
+    return -1;
+}
+
+int uring_read_files(struct uring_file * files, const int count){
+    return -1;
+}
+
+int uring_write_files(struct uring_file * files, const int count, int (*finish)(const int fd, struct uring_file * file, void * arg), void * arg){
+    return -1;
+}
+
+void uring_release(void){
+}
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef URING_H_INCLUDED
+#define URING_H_INCLUDED
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// io_uring is only used when the kernel headers are available
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_URING 1
+#endif
+#endif
+
+// most files handled by a single batch
+#define URING_BATCH 64
+
+// one file in a batch
+struct uring_file {
+    const char * path;                      // path relative to dirfd
+    int dirfd;                              // AT_FDCWD or an open directory
+    int flags;                              // open flags (writes only)
+    mode_t mode;                            // creation mode (writes only)
+    struct stat st;                         // filled in by uring_stat_files
+    char * data;                            // file contents
+    size_t size;                            // size of data
+    int result;                             // 0 on success, negative errno otherwise
+};
+
+// check whether io_uring can be used on this thread (set up on first use)
+int uring_available(void);
+
+// stat a batch of files
+int uring_stat_files(struct uring_file * files, const int count);
+
+// read regular files whose st has been filled in; data is allocated with malloc
+int uring_read_files(struct uring_file * files, const int count);
+
+// create files and write data into them
+// finish (may be NULL) is called with the open descriptor before it is closed
+int uring_write_files(struct uring_file * files, const int count, int (*finish)(const int fd, struct uring_file * file, void * arg), void * arg);
+
+// release this thread's ring
+void uring_release(void);
+
+#endif // URING_H_INCLUDED